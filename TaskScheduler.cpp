@@ -32,329 +32,3286 @@ Author:
 
 #define QUERY_INDEX_AUTH     0
 #define QUERY_INDEX_DATA     1
+#define QUERY_INDEX_BODY     2
+#define QUERY_INDEX_CURSOR   2
 
 #define SLEEP_SECOND_AFTER_ERROR 10
 
+#define DEFAULT_RETRY_MIN      1
+#define DEFAULT_RETRY_MAX      300
+#define DEFAULT_RECONNECT_MAX  30
+
+#define DEFAULT_MISFIRE        60
+
+#define CONTROL_POOL_NAME      "helper"
+#define DEFAULT_EXECUTION_POOL "worker"
+
+#define DEFAULT_LISTEN_CHANNEL "job"
+#define DEFAULT_POLL_INTERVAL  60
+
+#define DEFAULT_HEARTBEAT_INTERVAL 1000
+#define DEFAULT_HEARTBEAT_MAX      10000
+
+#define DEFAULT_CURSOR_COLUMN  "udate"
+#define DELTA_OVERLAP_SECONDS  5
+
+#define PREPARED_AUTHORIZE     "task_authorize"
+#define PREPARED_EXECUTE       "task_execute_action"
+#define PREPARED_LABEL         "task_set_label"
+#define PREPARED_JOB           "task_job"
+#define PREPARED_JOB_DELTA     "task_job_delta"
+#define PREPARED_CURSOR        "task_cursor"
+#define PREPARED_AUTH_CACHE    "task_authorize_cached"
+
+#define DEFAULT_AUTH_CACHE     60
+
+#define EXECUTOR_POLL_INTERVAL 1000
+#define EXECUTOR_LOG_SIZE      4096
+
+#define TRACE_BUFFER_SIZE      (4 * 1024 * 1024)
+
+#define DEFAULT_CLUSTER_CHANNEL "scheduler"
+#define DEFAULT_LEASE_SECONDS   15
+
 extern "C++" {
 
-namespace Apostol {
+namespace Apostol {
+
+    namespace Processes {
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTask -----------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CTask::CTask(CCollection *ACollection, const CJobRef &Job): CCollectionItem(ACollection), m_Job(Job) {
+            m_State = tsQueue;
+            m_Due = 0;
+            m_EnumDate = 0;
+            m_StartDate = 0;
+            m_RunDate = 0;
+            m_FinishDate = 0;
+            m_Deadline = 0;
+            m_Pipelined = false;
+            m_pQuery = nullptr;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJobPool --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CJobRef CJobPool::Get() {
+            CJobContext *pContext;
+
+            if (m_Free->empty()) {
+                pContext = new CJobContext();
+            } else {
+                pContext = m_Free->back().release();
+                m_Free->pop_back();
+            }
+
+            const std::weak_ptr<CFree> Free(m_Free);
+            const auto Limit = m_Limit;
+
+            return CJobRef(pContext, [Free, Limit](CJobContext *AContext) {
+                const auto pFree = Free.lock();
+                if (pFree && pFree->size() < Limit) {
+                    AContext->Clear();
+                    pFree->emplace_back(AContext);
+                } else {
+                    delete AContext;
+                }
+            });
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHistogram ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        static const double HistogramBounds[] = {0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300};
+        static const size_t HistogramSize = sizeof(HistogramBounds) / sizeof(HistogramBounds[0]);
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHistogram::CHistogram(): m_Buckets(HistogramSize, 0), m_Count(0), m_Sum(0) {
+
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHistogram::Observe(double Value) {
+            if (Value < 0)
+                Value = 0;
+
+            for (size_t i = 0; i < HistogramSize; ++i) {
+                if (Value <= HistogramBounds[i]) {
+                    m_Buckets[i]++;
+                    break;
+                }
+            }
+
+            m_Count++;
+            m_Sum += Value;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHistogram::Render(CString &Output, LPCTSTR Name, const CString &Labels) const {
+            const CString separator(Labels.IsEmpty() ? "" : ",");
+
+            unsigned long cumulative = 0;
+            for (size_t i = 0; i < HistogramSize; ++i) {
+                cumulative += m_Buckets[i];
+                Output << CString().Format("%s_bucket{%s%sle=\"%g\"} %lu\n", Name, Labels.c_str(), separator.c_str(), HistogramBounds[i], cumulative);
+            }
+
+            Output << CString().Format("%s_bucket{%s%sle=\"+Inf\"} %lu\n", Name, Labels.c_str(), separator.c_str(), m_Count);
+
+            if (Labels.IsEmpty()) {
+                Output << CString().Format("%s_sum %f\n", Name, m_Sum);
+                Output << CString().Format("%s_count %lu\n", Name, m_Count);
+            } else {
+                Output << CString().Format("%s_sum{%s} %f\n", Name, Labels.c_str(), m_Sum);
+                Output << CString().Format("%s_count{%s} %lu\n", Name, Labels.c_str(), m_Count);
+            }
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CBenchmark ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        static double SecondsSince(const std::chrono::steady_clock::time_point &Start) {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CBenchmark::Observe(LPCTSTR Phase, double Seconds) {
+            auto &phase = m_Phases[Phase];
+
+            phase.Count++;
+            phase.Total += Seconds;
+
+            if (Seconds > phase.Max)
+                phase.Max = Seconds;
+
+            // Reservoir sampling keeps the quantiles honest over a long window at a fixed memory cost.
+            if (phase.Samples.size() < m_Limit) {
+                phase.Samples.push_back(Seconds);
+            } else {
+                const auto i = (size_t) random() % phase.Count;
+                if (i < m_Limit)
+                    phase.Samples[i] = Seconds;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CBenchmark::Reset(CDateTime Now, unsigned long Started, unsigned long Finished) {
+            m_Phases.clear();
+
+            m_Start = Now;
+            m_Started = Started;
+            m_Finished = Finished;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        double CBenchmark::Quantile(std::vector<double> &Samples, double Value) {
+            if (Samples.empty())
+                return 0;
+
+            const auto n = (size_t) (Value * (double) (Samples.size() - 1));
+            std::nth_element(Samples.begin(), Samples.begin() + (long) n, Samples.end());
+
+            return Samples[n];
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CBenchmark::Report(CString &Output, CDateTime Now, unsigned long Started, unsigned long Finished) const {
+            const auto window = (Now - m_Start) * SecsPerDay;
+            const auto seconds = window > 0 ? window : 1;
+
+            const auto started = Started - m_Started;
+            const auto finished = Finished - m_Finished;
+
+            Output << CString().Format("window %.3f s: %lu started (%.1f/s), %lu finished (%.1f/s)\n",
+                                       window, started, (double) started / seconds, finished, (double) finished / seconds);
+
+            Output << CString().Format("%-12s %10s %10s %10s %10s %10s\n", "phase", "count", "p50 ms", "p99 ms", "max ms", "total s");
+
+            for (const auto &it : m_Phases) {
+                auto Samples(it.second.Samples);
+
+                const auto p50 = Quantile(Samples, 0.50);
+                const auto p99 = Quantile(Samples, 0.99);
+
+                Output << CString().Format("%-12s %10lu %10.3f %10.3f %10.3f %10.3f\n", it.first.c_str(), it.second.Count,
+                                           p50 * 1000, p99 * 1000, it.second.Max * 1000, it.second.Total);
+            }
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CProcessExecutor ------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CProcessExecutor::Commands(const CStringList &List) {
+            m_Commands.clear();
+            for (int i = 0; i < List.Count(); ++i) {
+                const auto &command = List.ValueFromIndex(i);
+                if (!command.IsEmpty())
+                    m_Commands[List.Names(i).c_str()] = command;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CProcessExecutor::Close(int &Handle) {
+            if (Handle != -1) {
+                ::close(Handle);
+                Handle = -1;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CProcessExecutor::TempFile() {
+            // An unlinked file: it goes away with its last descriptor.
+            char name[] = "/tmp/task-scheduler-XXXXXX";
+
+            const auto handle = mkostemp(name, O_CLOEXEC);
+            if (handle != -1)
+                unlink(name);
+
+            return handle;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CProcessExecutor::Start(const CJobRef &Job) {
+            const auto command = m_Commands.find(Job->TypeCode.c_str());
+            if (command == m_Commands.end())
+                throw Delphi::Exception::ExceptionFrm("[%s] No executor for type \"%s\".", Job->Id.c_str(), Job->TypeCode.c_str());
+
+            // The body, the output and the exit code go through files, not pipes: a child never waits
+            // for the scheduler to drain it, and its exit code survives whoever reaps it.
+            int Input = TempFile();
+            int Output = TempFile();
+            int Status = TempFile();
+
+            const auto Failed = [&](const char *What) {
+                const auto error = errno;
+                Close(Input);
+                Close(Output);
+                Close(Status);
+                return Delphi::Exception::ExceptionFrm("[%s] Executor %s failed: %s", Job->Id.c_str(), What, strerror(error));
+            };
+
+            if (Input == -1 || Output == -1 || Status == -1)
+                throw Failed("temporary file");
+
+            const std::string body(Job->Body.c_str());
+            size_t written = 0;
+            while (written < body.size()) {
+                const auto count = ::write(Input, body.data() + written, body.size() - written);
+                if (count == -1 && errno == EINTR)
+                    continue;
+                if (count <= 0)
+                    throw Failed("write");
+                written += (size_t) count;
+            }
+
+            lseek(Input, 0, SEEK_SET);
+
+            // The command runs in a subshell that does not see descriptor 3; the shell writes its exit code there.
+            CString script("(\n");
+            script << command->second << "\n) 3>&-\necho $? >&3";
+
+            const auto pid = fork();
+
+            if (pid == 0) {
+                // A group of its own: a cancel reaches the command, not only the shell.
+                setpgid(0, 0);
+
+                dup2(Input, STDIN_FILENO);
+                dup2(Output, STDOUT_FILENO);
+                dup2(Output, STDERR_FILENO);
+                dup2(Status, 3);
+
+                for (int fd = STDIN_FILENO; fd <= 3; ++fd)
+                    fcntl(fd, F_SETFD, 0);
+
+                const auto max = sysconf(_SC_OPEN_MAX);
+                for (long fd = 4; fd < (max > 0 && max < 65536 ? max : 65536); ++fd)
+                    ::close((int) fd);
+
+                sigset_t set;
+                sigemptyset(&set);
+                sigprocmask(SIG_SETMASK, &set, nullptr);
+                signal(SIGPIPE, SIG_DFL);
+
+                setenv("TASK_ID", Job->Id.c_str(), 1);
+                setenv("TASK_TYPECODE", Job->TypeCode.c_str(), 1);
+
+                execl("/bin/sh", "sh", "-c", script.c_str(), (char *) nullptr);
+                _exit(127);
+            }
+
+            if (pid == -1)
+                throw Failed("fork");
+
+            setpgid(pid, pid);
+            Close(Input);
+
+            auto &Child = m_Children[Job->Id.c_str()];
+
+            Child.Job = Job;
+            Child.Pid = pid;
+            Child.Output = Output;
+            Child.Status = Status;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CProcessExecutor::Cancel(const CString &Id) {
+            const auto it = m_Children.find(Id.c_str());
+            if (it == m_Children.end())
+                return false;
+
+            // The child is reaped and reported by the next poll.
+            return ::kill(-it->second.Pid, SIGTERM) == 0 || ::kill(it->second.Pid, SIGTERM) == 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CProcessExecutor::ExitCode(const CChild &Child, int Status, bool Reaped) {
+            // The command's own exit code, as the shell wrote it.
+            char buffer[16] = {0};
+            if (pread(Child.Status, buffer, sizeof(buffer) - 1, 0) > 0 && buffer[0] >= '0' && buffer[0] <= '9')
+                return (int) strtol(buffer, nullptr, 10);
+
+            // The shell did not get that far: it was killed, or someone else reaped it and the reason is lost.
+            if (Reaped && WIFSIGNALED(Status))
+                return 128 + WTERMSIG(Status);
+
+            if (Reaped && WIFEXITED(Status) && WEXITSTATUS(Status) != 0)
+                return WEXITSTATUS(Status);
+
+            return -1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CProcessExecutor::Tail(int Handle) {
+            const auto size = lseek(Handle, 0, SEEK_END);
+            if (size <= 0)
+                return CString();
+
+            const auto offset = size > EXECUTOR_LOG_SIZE ? size - EXECUTOR_LOG_SIZE : 0;
+
+            std::string data((size_t) (size - offset), '\0');
+
+            const auto count = pread(Handle, &data[0], data.size(), offset);
+            data.resize(count > 0 ? (size_t) count : 0);
+
+            return CString(data.c_str());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CProcessExecutor::Poll() {
+            for (auto it = m_Children.begin(); it != m_Children.end();) {
+                auto &Child = it->second;
+
+                int status = 0;
+                const auto pid = waitpid(Child.Pid, &status, WNOHANG);
+
+                if (pid == 0 || (pid == -1 && errno == EINTR)) {
+                    ++it;
+                    continue;
+                }
+
+                // -1 (ECHILD): the process has already been reaped elsewhere, so it is done all the same.
+                const auto code = ExitCode(Child, status, pid == Child.Pid);
+
+                const auto Job = Child.Job;
+                const auto Output = Tail(Child.Output);
+
+                Close(Child.Output);
+                Close(Child.Status);
+
+                it = m_Children.erase(it);
+
+                if (m_OnDone)
+                    m_OnDone(Job, code, code == -1 && Output.IsEmpty() ? CString("Executor exit status is unknown.") : Output);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CProcessExecutor::Stop() {
+            for (auto &it : m_Children)
+                ::kill(-it.second.Pid, SIGTERM);
+
+            // A second to finish, then the rest is killed; either way every child is reaped.
+            for (int i = 0; i < 100 && !m_Children.empty(); ++i) {
+                for (auto it = m_Children.begin(); it != m_Children.end();) {
+                    const auto pid = waitpid(it->second.Pid, nullptr, WNOHANG);
+                    if (pid == it->second.Pid || (pid == -1 && errno == ECHILD)) {
+                        Close(it->second.Output);
+                        Close(it->second.Status);
+                        it = m_Children.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+
+                if (!m_Children.empty())
+                    usleep(10000);
+            }
+
+            for (auto &it : m_Children) {
+                auto &Child = it.second;
+
+                ::kill(-Child.Pid, SIGKILL);
+                waitpid(Child.Pid, nullptr, 0);
+
+                Close(Child.Output);
+                Close(Child.Status);
+            }
+
+            m_Children.clear();
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJournal --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJournal::Open(const CString &FileName) {
+            Close();
+
+            m_FileName = FileName;
+            m_Entries.clear();
+            m_Lines = 0;
+
+            // One event per line: "S <mode> <id>" started, "X - <id>" body done, "E - <id>" gone.
+            // A line torn by a crash has no newline and is skipped.
+            auto pFile = fopen(m_FileName.c_str(), "r");
+            if (pFile != nullptr) {
+                char line[512];
+                while (fgets(line, sizeof(line), pFile) != nullptr) {
+                    const auto length = strlen(line);
+                    if (length < 5 || line[length - 1] != '\n' || line[1] != ' ' || line[3] != ' ')
+                        continue;
+
+                    line[length - 1] = '\0';
+                    const std::string id(line + 4);
+
+                    switch (line[0]) {
+                        case 'S':
+                            m_Entries[id].Mode = line[2];
+                            m_Entries[id].Executed = false;
+                            break;
+                        case 'X':
+                            m_Entries[id].Executed = true;
+                            break;
+                        case 'E':
+                            m_Entries.erase(id);
+                            break;
+                        default:
+                            break;
+                    }
+                }
+                fclose(pFile);
+            }
+
+            Compact();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJournal::Close() {
+            if (m_Handle != -1) {
+                Flush();
+                ::close(m_Handle);
+                m_Handle = -1;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJournal::Compact() {
+            // The live entries go to a new file that replaces the old one in a single rename.
+            const CString temp(m_FileName + ".tmp");
+
+            const auto handle = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+            if (handle == -1)
+                throw Delphi::Exception::ExceptionFrm("Journal \"%s\": %s", temp.c_str(), strerror(errno));
+
+            std::string data;
+            for (const auto &it : m_Entries) {
+                data.append("S ").append(1, it.second.Mode).append(" ").append(it.first).append("\n");
+                if (it.second.Executed)
+                    data.append("X - ").append(it.first).append("\n");
+            }
+
+            size_t written = 0;
+            while (written < data.size()) {
+                const auto count = ::write(handle, data.data() + written, data.size() - written);
+                if (count == -1 && errno == EINTR)
+                    continue;
+                if (count <= 0) {
+                    const auto error = errno;
+                    ::close(handle);
+                    throw Delphi::Exception::ExceptionFrm("Journal \"%s\": %s", temp.c_str(), strerror(error));
+                }
+                written += (size_t) count;
+            }
+
+            fdatasync(handle);
+            ::close(handle);
+
+            if (rename(temp.c_str(), m_FileName.c_str()) == -1)
+                throw Delphi::Exception::ExceptionFrm("Journal \"%s\": %s", m_FileName.c_str(), strerror(errno));
+
+            if (m_Handle != -1)
+                ::close(m_Handle);
+
+            m_Handle = ::open(m_FileName.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+            if (m_Handle == -1)
+                throw Delphi::Exception::ExceptionFrm("Journal \"%s\": %s", m_FileName.c_str(), strerror(errno));
+
+            m_Lines = m_Entries.size();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJournal::Append(char Event, char Mode, const CString &Id) {
+            m_Buffer.append(1, Event).append(" ").append(1, Mode).append(" ").append(Id.c_str()).append("\n");
+            m_Lines++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJournal::Start(const CString &Id, CMode Mode) {
+            if (m_Handle == -1)
+                return;
+
+            auto &Entry = m_Entries[Id.c_str()];
+
+            Entry.Mode = (char) Mode;
+            Entry.Executed = false;
+
+            Append('S', (char) Mode, Id);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJournal::Executed(const CString &Id) {
+            if (m_Handle == -1)
+                return;
+
+            const auto it = m_Entries.find(Id.c_str());
+            if (it == m_Entries.end())
+                return;
+
+            it->second.Executed = true;
+
+            Append('X', '-', Id);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJournal::End(const CString &Id) {
+            if (m_Handle == -1 || m_Entries.erase(Id.c_str()) == 0)
+                return;
+
+            Append('E', '-', Id);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        const CJournal::CEntry *CJournal::Find(const CString &Id) const {
+            const auto it = m_Entries.find(Id.c_str());
+            return it == m_Entries.end() ? nullptr : &it->second;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CJournal::Flush() {
+            if (m_Handle == -1 || m_Buffer.empty())
+                return;
+
+            size_t written = 0;
+            while (written < m_Buffer.size()) {
+                const auto count = ::write(m_Handle, m_Buffer.data() + written, m_Buffer.size() - written);
+                if (count == -1 && errno == EINTR)
+                    continue;
+                if (count <= 0) {
+                    // What the file took stays there: only the rest is written again, so no event is doubled or torn.
+                    const auto error = errno;
+                    m_Buffer.erase(0, written);
+                    throw Delphi::Exception::ExceptionFrm("Journal \"%s\": %s", m_FileName.c_str(), strerror(error));
+                }
+                written += (size_t) count;
+            }
+
+            m_Buffer.clear();
+
+            // One sync per loop iteration covers every event of that iteration.
+            if (fdatasync(m_Handle) == -1)
+                throw Delphi::Exception::ExceptionFrm("Journal \"%s\": %s", m_FileName.c_str(), strerror(errno));
+
+            if (m_Lines > 1024 && m_Lines > m_Entries.size() * 4)
+                Compact();
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTracer ---------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTracer::FileName(const CString &Value) {
+            // The file is reopened on the next flush: a reload after rotation starts a new one,
+            // and lines not written yet go there. With tracing turned off they have nowhere to go.
+            Close();
+            m_FileName = Value;
+            if (m_FileName.IsEmpty())
+                m_Buffer.clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTracer::Close() {
+            if (m_Handle != -1) {
+                ::close(m_Handle);
+                m_Handle = -1;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTracer::Span(std::string &Line, const char *Name, CDateTime From, CDateTime To) {
+            // A phase the job never went through is left out.
+            if (From == 0 || To == 0)
+                return;
+
+            char value[32];
+            snprintf(value, sizeof(value), "%.3f", To > From ? (To - From) * MSecsPerDay : 0.0);
+
+            Line.append(",\"").append(Name).append("\":").append(value);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTracer::Write(const CTask *ATask, const CString &Action, CDateTime Now) {
+            if (m_FileName.IsEmpty())
+                return;
+
+            const auto Quote = [](std::string &Line, const CString &Value) {
+                Line.append("\"");
+                for (auto p = Value.c_str(); *p != '\0'; ++p) {
+                    const auto c = *p;
+                    if (c == '"' || c == '\\')
+                        Line.append("\\");
+                    if ((unsigned char) c >= 0x20)
+                        Line.append(1, c);
+                }
+                Line.append("\"");
+            };
+
+            // One line per job: the wall clock of its enumeration and each phase in milliseconds,
+            // all measured by the event loop.
+            const auto enumerated = ATask->EnumDate() != 0 ? ATask->EnumDate() : ATask->StartDate();
+            const auto epoch = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count() - (long long) ((Now - enumerated) * MSecsPerDay);
+
+            // Waiting for its time is not queueing: the enumeration span runs from the later of the two.
+            const auto queued = ATask->Due() > enumerated ? ATask->Due() : enumerated;
+
+            std::string line("{\"ts\":");
+            line.append(std::to_string(epoch));
+            line.append(",\"id\":");
+            Quote(line, ATask->Id());
+            line.append(",\"type\":");
+            Quote(line, ATask->TypeCode());
+            line.append(",\"action\":");
+            Quote(line, Action);
+
+            Span(line, "enum", ATask->EnumDate() != 0 ? queued : 0, ATask->StartDate());
+            Span(line, "start", ATask->StartDate(), ATask->RunDate());
+            Span(line, "run", ATask->RunDate(), ATask->FinishDate());
+            Span(line, "finish", ATask->FinishDate(), Now);
+
+            line.append("}\n");
+
+            // A trace file that does not take writes costs whole lines, not memory.
+            if (m_Buffer.size() + line.size() <= TRACE_BUFFER_SIZE)
+                m_Buffer.append(line);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTracer::Flush() {
+            if (m_Buffer.empty())
+                return;
+
+            if (m_Handle == -1) {
+                m_Handle = ::open(m_FileName.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+                if (m_Handle == -1) {
+                    throw Delphi::Exception::ExceptionFrm("Trace \"%s\": %s", m_FileName.c_str(), strerror(errno));
+                }
+            }
+
+            // Whatever the file did not take stays for the next flush, so a line is never cut.
+            size_t written = 0;
+            while (written < m_Buffer.size()) {
+                const auto count = ::write(m_Handle, m_Buffer.data() + written, m_Buffer.size() - written);
+
+                if (count == -1 && errno == EINTR)
+                    continue;
+
+                if (count <= 0) {
+                    const auto error = errno;
+                    m_Buffer.erase(0, written);
+                    if (count == -1 && error != EAGAIN)
+                        throw Delphi::Exception::ExceptionFrm("Trace \"%s\": %s", m_FileName.c_str(), strerror(error));
+                    return;
+                }
+
+                written += (size_t) count;
+            }
+
+            m_Buffer.clear();
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTokenBucket ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTokenBucket::Refill(CDateTime Now) {
+            if (m_Stamp != 0 && Now > m_Stamp) {
+                m_Tokens += (Now - m_Stamp) * SecsPerDay * m_Rate;
+                if (m_Tokens > m_Burst)
+                    m_Tokens = m_Burst;
+            }
+
+            m_Stamp = Now;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTokenBucket::Ready(CDateTime Now) {
+            Refill(Now);
+            return m_Tokens >= 1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTokenBucket::Take(CDateTime Now) {
+            Refill(Now);
+            m_Tokens -= 1;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDateTime CTokenBucket::Next(CDateTime Now) {
+            Refill(Now);
+
+            if (m_Tokens >= 1 || m_Rate <= 0)
+                return Now;
+
+            return Now + (1 - m_Tokens) / m_Rate / SecsPerDay;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTokenBucket::Limits(const CTokenBucket &Value) {
+            // New limits, same level: what was spent stays spent.
+            m_Rate = Value.m_Rate;
+            m_Burst = Value.m_Burst;
+
+            if (m_Tokens > m_Burst)
+                m_Tokens = m_Burst;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTokenBucket::Parse(const CString &Value, CTokenBucket &Bucket) {
+            // "<jobs per second>[/<burst>]": "0.5" is one job every two seconds, "10/50" allows a burst of 50.
+            char *end = nullptr;
+
+            const auto rate = strtod(Value.c_str(), &end);
+            if (end == Value.c_str() || rate <= 0)
+                return false;
+
+            auto burst = rate;
+            if (*end == '/') {
+                burst = strtod(end + 1, nullptr);
+                if (burst <= 0)
+                    return false;
+            }
+
+            Bucket = CTokenBucket(rate, burst);
+
+            return true;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTaskManager ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CTask *CTaskManager::Get(int Index) const {
+            return dynamic_cast<CTask *> (inherited::GetItem(Index));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskManager::Set(int Index, CTask *Value) {
+            inherited::SetItem(Index, Value);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CTask *CTaskManager::Add(const CJobRef &Job) {
+            auto pTask = Find(Job->Id);
+            if (pTask == nullptr) {
+                pTask = new CTask(this, Job);
+                m_Index.emplace(Job->Id.c_str(), pTask);
+            }
+            return pTask;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CTask *CTaskManager::Find(const CString &Id) const {
+            const auto it = m_Index.find(Id.c_str());
+            return it == m_Index.end() ? nullptr : it->second;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTaskManager::Delete(const CString &Id) {
+            const auto it = m_Index.find(Id.c_str());
+            if (it == m_Index.end())
+                return false;
+
+            auto pTask = it->second;
+            m_Index.erase(it);
+            delete pTask;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskManager::Clear() {
+            m_Index.clear();
+            inherited::Clear();
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CReadyQueue -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CReadyQueue::Push(const CJobRef &Job, CDateTime Due) {
+            if (Contains(Job->Id))
+                return false;
+
+            const auto it = m_Items.insert({Job, Due, m_Sequence++}).first;
+            m_Index.emplace(Job->Id.c_str(), it);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CReadyQueue::Remove(const CString &Id) {
+            const auto it = m_Index.find(Id.c_str());
+            if (it == m_Index.end())
+                return false;
+
+            m_Items.erase(it->second);
+            m_Index.erase(it);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CReadyQueue::CIterator CReadyQueue::Erase(CIterator Position) {
+            m_Index.erase(Position->Job->Id.c_str());
+            return m_Items.erase(Position);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CReadyQueue::Clear() {
+            m_Index.clear();
+            m_Items.clear();
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTaskScheduler --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CTaskScheduler::CTaskScheduler(CCustomProcess *AParent, CApplication *AApplication):
+                inherited(AParent, AApplication, "task scheduler") {
+
+            m_Agent = CString().Format("%s (%s)", GApplication->Title().c_str(), ProcessName().c_str());
+            m_Host = CApostolModule::GetIPByHostName(CApostolModule::GetHostName());
+
+            m_AuthDate = 0;
+            m_CheckDate = 0;
+            m_ListenDate = 0;
+
+            m_NotifiedAll = false;
+
+            m_Pipeline = false;
+            m_Batch = true;
+            m_FanIn = true;
+
+            m_Delta = true;
+            m_DeltaErrors = 0;
+            m_CursorColumn = DEFAULT_CURSOR_COLUMN;
+
+            m_Notify = true;
+            m_Channel = DEFAULT_LISTEN_CHANNEL;
+
+            m_MaxJobs = 0;
+            m_Active = 0;
+
+            m_RateDate = 0;
+
+            m_PendingDate = 0;
+            m_PendingCheck = false;
+            m_PendingAgain = false;
+
+            m_MetricsPort = 0;
+
+            m_Timeout = 0;
+
+            m_BenchInterval = 0;
+            m_BenchDate = 0;
+
+            m_Prepare = true;
+            m_AuthCache = DEFAULT_AUTH_CACHE;
+
+            m_Cluster = false;
+            m_ClusterChannel = DEFAULT_CLUSTER_CHANNEL;
+            m_Lease = DEFAULT_LEASE_SECONDS * 1000;
+            m_AnnounceDate = 0;
+            m_JoinDate = 0;
+
+            m_RetryMin = DEFAULT_RETRY_MIN * 1000;
+            m_RetryMax = DEFAULT_RETRY_MAX * 1000;
+            m_ReconnectMax = DEFAULT_RECONNECT_MAX * 1000;
+
+            m_Misfire = DEFAULT_MISFIRE * 1000;
+            m_CatchUp = 0;
+            m_MisfirePolicy = mpAll;
+
+            m_HeartbeatInterval = DEFAULT_HEARTBEAT_INTERVAL;
+            m_HeartbeatMax = DEFAULT_HEARTBEAT_MAX;
+            m_Heartbeat = m_HeartbeatInterval;
+            m_Idle = false;
+
+            m_PollInterval = DEFAULT_POLL_INTERVAL * 1000;
+
+            m_Executors.push_back(&m_Processes);
+
+            m_Processes.OnDone([this](const CJobRef &Job, int Status, const CString &Output) {
+                ExecutorDone(Job, Status, Output);
+            });
+
+            m_Status = psStopped;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        template<class TExecuted, class TException>
+        CPQPollQuery *CTaskScheduler::ExecPool(CPQPool &Pool, const CStringList &SQL, TExecuted &&OnExecuted, TException &&OnException) {
+
+            auto pPool = &Pool;
+
+            auto Executed = [this, pPool, OnExecuted](CPQPollQuery *APollQuery) {
+                LeavePool(*pPool);
+                OnExecuted(APollQuery);
+            };
+
+            auto Exception = [this, pPool, OnException](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                LeavePool(*pPool);
+                OnException(APollQuery, E);
+            };
+
+            CPQPollQuery *pQuery;
+
+            if (Pool.Client == nullptr || Pool.Name == CONTROL_POOL_NAME) {
+                pQuery = ExecSQL(SQL, nullptr, Executed, Exception);
+            } else {
+                pQuery = Pool.Client->GetQuery();
+
+                if (pQuery == nullptr)
+                    throw Delphi::Exception::ExceptionFrm("ExecPool: Pool \"%s\" is not active.", Pool.Name.c_str());
+
+                pQuery->SQL() = SQL;
+
+                pQuery->OnPollExecuted(Executed);
+                pQuery->OnException(Exception);
+
+                if (pQuery->Start() == POLL_QUERY_START_ERROR) {
+                    delete pQuery;
+                    throw Delphi::Exception::ExceptionFrm("ExecPool: Start SQL query on pool \"%s\" failed.", Pool.Name.c_str());
+                }
+            }
+
+            EnterPool(Pool);
+
+            return pQuery;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        template<class TExecuted, class TException>
+        CPQPollQuery *CTaskScheduler::ExecConnection(CPQConnection *AConnection, const CStringList &SQL, TExecuted &&OnExecuted, TException &&OnException) {
+            auto pQuery = AConnection->Client()->GetQuery();
+
+            if (pQuery == nullptr)
+                throw Delphi::Exception::ExceptionFrm("ExecConnection: Client of connection %d is not active.", PQsocket(AConnection->Handle()));
+
+            // Bound to the connection: it runs there before anything waiting in the client's queue.
+            pQuery->Connection(AConnection);
+            pQuery->SQL() = SQL;
+
+            pQuery->OnPollExecuted(OnExecuted);
+            pQuery->OnException(OnException);
+
+            if (pQuery->StartQuery() == POLL_QUERY_START_ERROR) {
+                delete pQuery;
+                throw Delphi::Exception::ExceptionFrm("ExecConnection: Start SQL query on connection %d failed.", PQsocket(AConnection->Handle()));
+            }
+
+            return pQuery;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::EnterPool(CPQPool &Pool) {
+            Pool.Busy++;
+
+            if (Pool.Busy > Pool.Peak)
+                Pool.Peak = Pool.Busy;
+
+            if (!Pool.Saturated && Pool.Busy >= Pool.Size) {
+                Pool.Saturated = true;
+                Log()->Notice("[%s] Pool \"%s\" is saturated: %d queries on %d connections", CONFIG_SECTION_NAME,
+                              Pool.Name.c_str(), Pool.Busy, Pool.Size);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::LeavePool(CPQPool &Pool) {
+            if (Pool.Busy > 0)
+                Pool.Busy--;
+
+            if (Pool.Saturated && Pool.Busy < Pool.Size) {
+                Pool.Saturated = false;
+                Log()->Notice("[%s] Pool \"%s\" is no longer saturated (peak: %d)", CONFIG_SECTION_NAME,
+                              Pool.Name.c_str(), Pool.Peak);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::BeforeRun() {
+            Application()->Header(Application()->Name() + ": task scheduler");
+
+            Log()->Debug(APP_LOG_DEBUG_CORE, MSG_PROCESS_START, GetProcessName(), Application()->Header().c_str());
+
+            InitSignals();
+
+            Reload();
+
+            SetUser(Config()->User(), Config()->Group());
+
+            // The file name applies on restart: the journal is what a restart recovers from.
+            if (!m_JournalFile.IsEmpty()) {
+                try {
+                    m_Journal.Open(m_JournalFile);
+                    Log()->Notice("[%s] Journal \"%s\": %d jobs were in flight", CONFIG_SECTION_NAME,
+                                  m_JournalFile.c_str(), (int) m_Journal.Count());
+                } catch (Delphi::Exception::Exception &E) {
+                    Log()->Error(APP_LOG_ERR, 0, "[%s] %s", CONFIG_SECTION_NAME, E.what());
+                }
+            }
+
+            InitializePQClients(Application()->Title(), 1, Config()->PostgresPollMin());
+
+            if (m_MetricsPort > 0) {
+                InitializeServer(Application()->Title(), Config()->Listen(), m_MetricsPort);
+            }
+
+            SigProcMask(SIG_UNBLOCK);
+
+            SetTimerInterval(m_HeartbeatInterval);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::AfterRun() {
+            // Jobs left running are found "executed" by the next start and canceled as orphans.
+            for (auto pExecutor : m_Executors)
+                pExecutor->Stop();
+
+            try {
+                m_Journal.Close();
+            } catch (Delphi::Exception::Exception &E) {
+                Log()->Error(APP_LOG_ERR, 0, "[%s] %s", CONFIG_SECTION_NAME, E.what());
+            }
+
+            CApplicationProcess::AfterRun();
+            PQClientsStop();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTaskScheduler::InProgress(const CString &Id) {
+            return m_Jobs.Find(Id) != nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Run() {
+            auto &PQClient = PQClientStart(CONTROL_POOL_NAME);
+
+            m_Control.Client = &PQClient;
+            m_Execution.Client = &PQClient;
+
+            if (m_Execution.Name != m_Control.Name) {
+                try {
+                    m_Execution.Client = &PQClientStart(m_Execution.Name);
+                } catch (Delphi::Exception::Exception &E) {
+                    Log()->Error(APP_LOG_ERR, 0, "[%s] Execution pool \"%s\" is not available: %s", CONFIG_SECTION_NAME, m_Execution.Name.c_str(), E.what());
+                    m_Execution.Name = m_Control.Name;
+                }
+            }
+
+            while (!sig_exiting) {
+
+                Log()->Debug(APP_LOG_DEBUG_EVENT, _T("task scheduler cycle"));
+
+                try {
+                    PQClient.Wait();
+                } catch (Delphi::Exception::Exception &E) {
+                    Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
+                }
+
+                CheckNotified();
+                CheckTimeout();
+                CheckExecutors();
+                Dispatch();
+
+                // Make the events of this iteration durable before their transitions leave.
+                try {
+                    m_Journal.Flush();
+                } catch (Delphi::Exception::Exception &E) {
+                    Log()->Error(APP_LOG_ERR, 0, "[%s] %s", CONFIG_SECTION_NAME, E.what());
+                }
+
+                try {
+                    m_Tracer.Flush();
+                } catch (Delphi::Exception::Exception &E) {
+                    Log()->Error(APP_LOG_ERR, 0, "[%s] %s", CONFIG_SECTION_NAME, E.what());
+                }
+
+                FlushTransitions();
+                ScheduleTimer();
+
+                if (sig_terminate || sig_quit) {
+                    if (sig_quit) {
+                        sig_quit = 0;
+                        Log()->Debug(APP_LOG_DEBUG_EVENT, _T("gracefully shutting down"));
+                        Application()->Header(_T("task scheduler is shutting down"));
+                    }
+
+                    if (!sig_exiting) {
+                        sig_exiting = 1;
+                    }
+                }
+
+                if (sig_reconfigure) {
+                    sig_reconfigure = 0;
+                    Log()->Debug(APP_LOG_DEBUG_EVENT, _T("reconfiguring"));
+
+                    Reload();
+                }
+
+                if (sig_reopen) {
+                    sig_reopen = 0;
+                    Log()->Debug(APP_LOG_DEBUG_EVENT, _T("reopening logs"));
+                }
+            }
+
+            m_Control.Client = nullptr;
+            m_Execution.Client = nullptr;
+
+            Log()->Debug(APP_LOG_DEBUG_EVENT, _T("stop task scheduler"));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::LoadConfig() {
+            m_MetricsPort = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "metrics", 0);
+
+            m_Timeout = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "timeout", 0) * 1000;
+
+            if (!m_Journal.Active())
+                m_JournalFile = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "journal", "");
+
+            m_Tracer.FileName(Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "trace", ""));
+
+            m_BenchInterval = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "bench", 0) * 1000;
+
+            CStringList Timeouts;
+            Config()->IniFile().ReadSectionValues(CONFIG_SECTION_NAME "/timeout", &Timeouts);
+
+            m_Timeouts.clear();
+            for (int i = 0; i < Timeouts.Count(); ++i) {
+                const auto timeout = StrToIntDef(Timeouts.ValueFromIndex(i).c_str(), -1);
+                if (timeout >= 0)
+                    m_Timeouts[Timeouts.Names(i).c_str()] = timeout * 1000;
+            }
+
+            m_Misfire = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "misfire", DEFAULT_MISFIRE) * 1000;
+            m_CatchUp = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "catchup", 0) * 1000;
+
+            if (!ParseMisfire(Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "misfire_policy", "all"), m_MisfirePolicy))
+                m_MisfirePolicy = mpAll;
+
+            CStringList Policies;
+            Config()->IniFile().ReadSectionValues(CONFIG_SECTION_NAME "/misfire", &Policies);
+
+            m_MisfirePolicies.clear();
+            for (int i = 0; i < Policies.Count(); ++i) {
+                CMisfirePolicy policy;
+                if (ParseMisfire(Policies.ValueFromIndex(i), policy)) {
+                    m_MisfirePolicies[Policies.Names(i).c_str()] = policy;
+                } else {
+                    Log()->Error(APP_LOG_ERR, 0, "[%s/misfire] Invalid policy \"%s\" for \"%s\"", CONFIG_SECTION_NAME,
+                                 Policies.ValueFromIndex(i).c_str(), Policies.Names(i).c_str());
+                }
+            }
+
+            m_RetryMin = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "retry_min", DEFAULT_RETRY_MIN) * 1000;
+            m_RetryMax = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "retry_max", DEFAULT_RETRY_MAX) * 1000;
+            m_ReconnectMax = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "reconnect_max", DEFAULT_RECONNECT_MAX) * 1000;
+
+            m_Pipeline = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "pipeline", false);
+            m_Batch = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "batch", true);
+            m_FanIn = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "fan_in", true);
+
+            m_Delta = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "delta", true);
+            m_DeltaErrors = 0;
+            m_CursorColumn = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "cursor", DEFAULT_CURSOR_COLUMN);
+
+            // Notifications from a previous channel are ignored by DoPostgresNotify.
+            m_Notify = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "notify", true);
+            m_Channel = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "channel", DEFAULT_LISTEN_CHANNEL);
+
+            // Membership is built once, when the node joins: the cluster settings apply on restart.
+            if (m_Control.Client == nullptr) {
+                m_Cluster = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "cluster", false);
+                m_ClusterChannel = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "cluster_channel", DEFAULT_CLUSTER_CHANNEL);
+                m_Node = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "node", CString().Format("%s:%d", m_Host.c_str(), getpid()));
+            }
+
+            m_Lease = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "lease", DEFAULT_LEASE_SECONDS) * 1000;
+            if (m_Lease < 3000)
+                m_Lease = 3000;
+
+            // Nodes find each other through notifications, so a cluster cannot do without them.
+            if (m_Cluster && !m_Notify) {
+                m_Notify = true;
+                Log()->Notice("[%s] Notifications are enabled for the cluster mode", CONFIG_SECTION_NAME);
+            }
+
+            m_HeartbeatInterval = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "heartbeat", DEFAULT_HEARTBEAT_INTERVAL);
+            if (m_HeartbeatInterval < 1)
+                m_HeartbeatInterval = 1;
+
+            m_HeartbeatMax = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "heartbeat_max", DEFAULT_HEARTBEAT_MAX);
+            if (m_HeartbeatMax < m_HeartbeatInterval)
+                m_HeartbeatMax = m_HeartbeatInterval;
+
+            m_PollInterval = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "poll", DEFAULT_POLL_INTERVAL) * 1000;
+
+            if (m_PollInterval < m_HeartbeatInterval)
+                m_PollInterval = m_HeartbeatInterval;
+
+            // Statements are prepared as connections come up, so the switch applies on restart.
+            if (m_Control.Client == nullptr) {
+                m_Prepare = Config()->IniFile().ReadBool(CONFIG_SECTION_NAME, "prepare", true);
+                m_AuthCache = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "auth_cache", DEFAULT_AUTH_CACHE);
+                m_PreparedColumn = m_CursorColumn;
+            }
+
+            m_Control.Name = CONTROL_POOL_NAME;
+
+            // The clients keep the connections they were started with: the size follows them, not the file.
+            if (m_Control.Client == nullptr)
+                m_Control.Size = Config()->PostgresPollMin();
+
+            // A running client cannot be swapped for another one: the pool name and size apply on restart.
+            if (m_Execution.Client == nullptr) {
+                m_Execution.Name = Config()->IniFile().ReadString(CONFIG_SECTION_NAME, "pool", DEFAULT_EXECUTION_POOL);
+                if (m_Execution.Name.IsEmpty())
+                    m_Execution.Name = m_Control.Name;
+                m_Execution.Size = Config()->PostgresPollMin();
+            }
+
+            // A shared pool keeps one connection for polling and state transitions.
+            const auto shared = m_Execution.Name == m_Control.Name;
+
+            m_MaxJobs = Config()->IniFile().ReadInteger(CONFIG_SECTION_NAME, "max_jobs", shared ? m_Execution.Size - 1 : m_Execution.Size);
+            if (m_MaxJobs < 1)
+                m_MaxJobs = 1;
+
+            CStringList Limits;
+            Config()->IniFile().ReadSectionValues(CONFIG_SECTION_NAME "/limits", &Limits);
+
+            m_TypeLimits.clear();
+            for (int i = 0; i < Limits.Count(); ++i) {
+                const auto limit = StrToIntDef(Limits.ValueFromIndex(i).c_str(), 0);
+                if (limit > 0)
+                    m_TypeLimits[Limits.Names(i).c_str()] = limit;
+            }
+
+            LoadDepends();
+            LoadRates();
+
+            CStringList Executors;
+            Config()->IniFile().ReadSectionValues(CONFIG_SECTION_NAME "/executors", &Executors);
+
+            m_Processes.Commands(Executors);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::LoadDepends() {
+            CStringList Depends;
+            Config()->IniFile().ReadSectionValues(CONFIG_SECTION_NAME "/depends", &Depends);
+
+            m_Depends.clear();
+            for (int i = 0; i < Depends.Count(); ++i) {
+                const std::string value(Depends.ValueFromIndex(i).c_str());
+
+                auto &upstream = m_Depends[Depends.Names(i).c_str()];
+
+                size_t start = 0;
+                while (start <= value.size()) {
+                    auto end = value.find(',', start);
+                    if (end == std::string::npos)
+                        end = value.size();
+
+                    auto item = value.substr(start, end - start);
+                    item.erase(0, item.find_first_not_of(" \t"));
+                    item.erase(item.find_last_not_of(" \t") + 1);
+
+                    if (!item.empty())
+                        upstream.push_back(item);
+
+                    start = end + 1;
+                }
+            }
+
+            // A cycle would block its jobs forever: the edge that closes it is dropped.
+            std::unordered_map<std::string, int> Visited; // 1 - on the path, 2 - done
+
+            std::function<void(const std::string &)> Visit = [this, &Visited, &Visit](const std::string &Node) {
+                Visited[Node] = 1;
+
+                const auto it = m_Depends.find(Node);
+                if (it != m_Depends.end()) {
+                    auto &upstream = it->second;
+                    for (auto item = upstream.begin(); item != upstream.end();) {
+                        const auto state = Visited[*item];
+                        if (state == 1) {
+                            Log()->Error(APP_LOG_ERR, 0, "[%s] Dependency cycle: \"%s\" on \"%s\" is ignored", CONFIG_SECTION_NAME,
+                                         Node.c_str(), item->c_str());
+                            item = upstream.erase(item);
+                            continue;
+                        }
+                        if (state == 0)
+                            Visit(*item);
+                        ++item;
+                    }
+                }
+
+                Visited[Node] = 2;
+            };
+
+            for (const auto &it : m_Depends) {
+                if (Visited[it.first] == 0)
+                    Visit(it.first);
+            }
+
+            m_Upstream.clear();
+            for (const auto &it : m_Depends) {
+                m_Upstream.insert(it.second.begin(), it.second.end());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::LoadRates() {
+            CStringList Rates;
+
+            const auto Load = [&Rates](const char *Section, std::unordered_map<std::string, CTokenBucket> &Buckets) {
+                Rates.Clear();
+                Config()->IniFile().ReadSectionValues(Section, &Rates);
+
+                std::unordered_map<std::string, CTokenBucket> Loaded;
+                for (int i = 0; i < Rates.Count(); ++i) {
+                    CTokenBucket bucket;
+                    if (CTokenBucket::Parse(Rates.ValueFromIndex(i), bucket)) {
+                        const std::string name(Rates.Names(i).c_str());
+                        const auto it = Buckets.find(name);
+                        if (it != Buckets.end()) {
+                            it->second.Limits(bucket);
+                            bucket = it->second;
+                        }
+                        Loaded[name] = bucket;
+                    } else {
+                        Log()->Error(APP_LOG_ERR, 0, "[%s] Invalid rate \"%s\" for \"%s\"", Section,
+                                     Rates.ValueFromIndex(i).c_str(), Rates.Names(i).c_str());
+                    }
+                }
+
+                Buckets.swap(Loaded);
+            };
+
+            Load(CONFIG_SECTION_NAME "/rates", m_TypeRates);
+            Load(CONFIG_SECTION_NAME "/session_rates", m_SessionRates);
+
+            // A reload changes the limits, not the level: a bucket refilled on every reload would let a burst through.
+            for (auto it = m_SessionBuckets.begin(); it != m_SessionBuckets.end();) {
+                auto rate = m_SessionRates.find(it->first);
+                if (rate == m_SessionRates.end())
+                    rate = m_SessionRates.find("*");
+
+                if (rate == m_SessionRates.end()) {
+                    it = m_SessionBuckets.erase(it);
+                } else {
+                    it->second.Limits(rate->second);
+                    ++it;
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Reload() {
+            CServerProcess::Reload();
+
+            LoadConfig();
+
+            // In-flight jobs, their queries and the known sessions survive a reload: dispatch goes on
+            // while the scheduler signs in again in the background and resyncs the whole job list.
+            m_Cursors.clear();
+            m_Notified.clear();
+            m_NotifiedAll = false;
+
+            // Peers are kept: the listening connection survives a reload, so nobody would answer a new join
+            // and jobs that live peers are executing would look orphaned.
+            m_Reconnect = CBackoff();
+
+            m_Bench.Reset(Now(), m_Metrics.Started, m_Metrics.Finished);
+            m_BenchDate = Now() + (CDateTime) m_BenchInterval / MSecsPerDay;
+
+            m_AuthDate = 0;
+            m_CheckDate = 0;
+            m_ListenDate = 0;
+
+            Activity();
+
+            // Dependencies may have been removed.
+            Unblock();
+
+            Log()->Notice("[%s] Successful reloading", CONFIG_SECTION_NAME);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Authentication() {
+
+            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+
+                CPQueryResults pqResults;
+
+                CStringList SQL;
+
+                try {
+                    CApostolModule::QueryToResults(APollQuery, pqResults);
+
+                    const auto &login = pqResults[0];
+                    const auto &sessions = pqResults[1];
+
+                    const auto &session = login.First()["session"];
+
+                    m_Sessions.Clear();
+                    m_Cursors.clear();
+                    for (int i = 0; i < sessions.Count(); ++i) {
+                        m_Sessions.Add(sessions[i]["get_sessions"]);
+                    }
+
+                    m_AuthDate = Now() + (CDateTime) 24 / HoursPerDay;
+                    m_Status = psRunning;
+
+                    SignOut(session);
+                } catch (Delphi::Exception::Exception &E) {
+                    DoFatal(E);
+                }
+            };
+
+            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoFatal(E);
+            };
+
+            const auto &caProviders = Server().Providers();
+            const auto &caProvider = caProviders.DefaultValue();
+
+            const auto &clientId = caProvider.ClientId(SERVICE_APPLICATION_NAME);
+            const auto &clientSecret = caProvider.Secret(SERVICE_APPLICATION_NAME);
+
+            CStringList SQL;
+
+            api::login(SQL, clientId, clientSecret, m_Agent, m_Host);
+            api::get_sessions(SQL, API_BOT_USERNAME, m_Agent, m_Host);
+
+            try {
+                ExecPool(m_Control, SQL, OnExecuted, OnException);
+            } catch (Delphi::Exception::Exception &E) {
+                DoFatal(E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::SignOut(const CString &Session) {
+            CStringList SQL;
+
+            api::signout(SQL, Session);
+
+            try {
+                ExecSQL(SQL);
+            } catch (Delphi::Exception::Exception &E) {
+                DoConnectError(E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::InitListen() {
+
+            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+                CPQResult *pResult;
+                try {
+                    for (int i = 0; i < APollQuery->Count(); i++) {
+                        pResult = APollQuery->Results(i);
+
+                        if (pResult->ExecStatus() != PGRES_COMMAND_OK)
+                            throw Delphi::Exception::EDBError(pResult->GetErrorMessage());
+                    }
+
+                    APollQuery->Connection()->Listeners().Add(m_Channel);
+                    if (m_Cluster)
+                        APollQuery->Connection()->Listeners().Add(m_ClusterChannel);
+
+                    APollQuery->Connection()->OnNotify([this](CPQConnection *AConnection, PGnotify *ANotify) {
+                        DoPostgresNotify(AConnection, ANotify);
+                    });
+
+                    Log()->Notice("[%s] Listening on channel \"%s\"", CONFIG_SECTION_NAME, m_Channel.c_str());
+
+                    if (m_Cluster) {
+                        // Peers answer the join at once: wait for them before claiming any job.
+                        m_Nodes.clear();
+                        m_Cursors.clear();
+                        m_JoinDate = Now() + (CDateTime) m_Lease / 3 / MSecsPerDay;
+                        m_CheckDate = m_JoinDate;
+                        Announce(true);
+                    } else {
+                        // Catch up on everything that changed while nobody was listening.
+                        CheckJob();
+                    }
+                } catch (Delphi::Exception::Exception &E) {
+                    DoError(E);
+                }
+            };
+
+            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoError(E);
+            };
+
+            CStringList SQL;
+
+            SQL.Add(CString().Format("LISTEN %s;", m_Channel.c_str()));
+
+            if (m_Cluster)
+                SQL.Add(CString().Format("LISTEN %s;", m_ClusterChannel.c_str()));
+
+            try {
+                ExecPool(m_Control, SQL, OnExecuted, OnException);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTaskScheduler::CheckListen() {
+            return m_Notify && m_Control.Client != nullptr && m_Control.Client->CheckListen(m_Channel);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::EnumJob(const CString &Session, const CPQueryResult &List, const CStringList &Scope, bool Full) {
+            CString Error;
+            std::unordered_set<std::string> Seen;
+
+            // Anything new to queue, cancel or finish keeps the heartbeat at its fastest.
+            bool active = false;
+
+            for (int row = 0; row < List.Count(); ++row) {
+                const auto &job = List[row];
+
+                const auto &id = job["id"];
+                const auto &type_code = job["typecode"];
+                const auto &state_code = job["statecode"];
+                const auto &body = job["body"];
+
+                Seen.emplace(id.c_str());
+
+                const auto runnable = state_code == "enabled" || state_code == "aborted" || state_code == "failed";
+
+                auto pTask = m_Jobs.Find(id);
+
+                if (pTask != nullptr && pTask->State() == tsQueue) {
+                    // Disabled, finished or started elsewhere since it was fetched: it must not be started from here.
+                    if (!runnable && state_code != "canceled") {
+                        Log()->Debug(APP_LOG_DEBUG_CORE, "[%s] Task is no longer runnable.", id.c_str());
+                        DeleteJob(id);
+                        m_Retry.erase(id.c_str());
+                        active = true;
+                        continue;
+                    }
+
+                    // A job fetched ahead that was moved, or whose body or type changed, is queued again from the new row.
+                    const auto &queued = pTask->Job();
+                    if (runnable && (queued->DateRun != job["daterun"] || queued->Body != body || queued->TypeCode != type_code)) {
+                        Log()->Debug(APP_LOG_DEBUG_CORE, "[%s] Task was rescheduled.", id.c_str());
+                        DeleteJob(id);
+                        pTask = nullptr;
+                    }
+                }
+
+                if (pTask != nullptr) {
+                    if (state_code == "canceled" && pTask->State() != tsTimeout) {
+                        active = true;
+
+                        auto pQuery = pTask->Query();
+                        if (pTask->State() == tsQueue) {
+                            const auto job = pTask->Job();
+                            DeleteJob(id);
+                            DoAbort(job);
+                        } else if (pQuery != nullptr) {
+                            pTask->State(tsFinish);
+                            if (pQuery->CancelQuery(Error)) {
+                                DoAbort(pTask->Job());
+                            } else {
+                                DoFail(pTask->Job(), Error);
+                            }
+                        } else if (pTask->State() == tsRun) {
+                            const auto pExecutor = Executor(pTask->TypeCode());
+                            if (pExecutor != nullptr && pExecutor->Cancel(id)) {
+                                pTask->State(tsFinish);
+                                DoAbort(pTask->Job());
+                            }
+                        }
+                    }
+                } else if (Owned(id)) {
+                    active = true;
+
+                    if (!runnable)
+                        m_Retry.erase(id.c_str());
+
+                    // A changed row may have been moved past the look-ahead window: it comes back in a later list.
+                    if (runnable && job["ahead"] != "f") {
+                        const auto delay = strtoll(job["delay"].c_str(), nullptr, 10);
+
+                        auto due = Now() + (CDateTime) delay / MSecsPerDay;
+
+                        bool skip = false;
+                        const auto missed = Misfired(id, type_code, delay, due, skip);
+
+                        // A job that failed recently waits out its own backoff instead of the whole scheduler.
+                        const auto retry = m_Retry.find(id.c_str());
+                        if (retry != m_Retry.end() && retry->second.Until > due)
+                            due = retry->second.Until;
+
+                        Enqueue(Session, id, type_code, body, job["daterun"], due, missed, skip);
+                    } else if (state_code == "executed") {
+                        // A job executed by a live peer is not an orphan; before the join window has passed, no peer is known.
+                        if ((!m_Cluster || (Now() >= m_JoinDate && Orphaned(job["label"]))) && !JobRecovered(Session, id, type_code))
+                            DoCancel(NewJob(Session, id));
+                    } else if (state_code == "canceled") {
+                        DoAbort(NewJob(Session, id));
+                    }
+                }
+            }
+
+            // A job that is still waiting for its time but has left the list was disabled or rescheduled.
+            CStringList Stale;
+
+            if (Full) {
+                for (int i = 0; i < m_Jobs.Count(); ++i) {
+                    const auto pTask = m_Jobs.Tasks(i);
+                    if (pTask->State() == tsQueue && pTask->Session() == Session && Seen.count(pTask->Id().c_str()) == 0)
+                        Stale.Add(pTask->Id());
+                }
+            } else {
+                // An incremental list says nothing about the jobs it does not contain.
+                for (int i = 0; i < Scope.Count(); ++i) {
+                    const auto pTask = m_Jobs.Find(Scope[i]);
+                    if (pTask != nullptr && pTask->State() == tsQueue && pTask->Session() == Session && Seen.count(pTask->Id().c_str()) == 0)
+                        Stale.Add(pTask->Id());
+                }
+            }
+
+            for (int i = 0; i < Stale.Count(); ++i) {
+                DeleteJob(Stale[i]);
+                m_Retry.erase(Stale[i].c_str());
+            }
+
+            if (active || Stale.Count() != 0)
+                Activity();
+
+            Dispatch();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::CheckJob(const CStringList &Ids) {
+            CheckJob(Ids, m_Sessions);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::CheckJob(const CStringList &Ids, const CStringList &Sessions) {
+
+            typedef std::vector<std::pair<CString, bool>> CSessions; // session, incremental
+
+            const auto full = Ids.Count() == 0;
+            const auto size = full ? 3 : 2; // authorize, job list and, for a whole-list sync, the cursor
+
+            const auto sent = Now();
+
+            auto OnEnum = [this, Ids, full, size, sent](CPQPollQuery *APollQuery, const CSessions &Sessions) {
+
+                CPQueryResults pqResults;
+
+                m_Metrics.CheckJob.Observe((Now() - sent) * SecsPerDay);
+
+                if (m_BenchInterval > 0)
+                    m_Bench.Observe("check_job", (Now() - sent) * SecsPerDay);
+
+                // The control connection answered, so any reconnect backoff is over.
+                m_Reconnect = CBackoff();
+
+                // All blocks share one implicit transaction: an error in one of them aborts the ones after it.
+                // The failed session is reported on its own and the others are asked again without it.
+                const auto total = (int) Sessions.size() * size;
+
+                int failed = 0;
+                CString error("no result");
+
+                for (; failed < APollQuery->Count() && failed < total; ++failed) {
+                    const auto pResult = APollQuery->Results(failed);
+                    if (pResult->ExecStatus() != PGRES_TUPLES_OK) {
+                        error = pResult->GetErrorMessage();
+                        break;
+                    }
+                }
+
+                if (failed < total) {
+                    const auto block = failed / size;
+
+                    const auto &session = Sessions[block].first;
+                    m_Cursors.erase(session.c_str());
+
+                    if (Sessions[block].second && ++m_DeltaErrors >= 3) {
+                        m_Delta = false;
+                        Log()->Notice("[%s] Incremental sync is disabled after repeated errors", CONFIG_SECTION_NAME);
+                    }
+
+                    CStringList Rest;
+                    for (size_t i = 0; i < Sessions.size(); ++i) {
+                        if ((int) i != block)
+                            Rest.Add(Sessions[i].first);
+                    }
+
+                    DoError(Delphi::Exception::ExceptionFrm("Session \"%s\": %s", session.c_str(), error.c_str()));
+
+                    if (Rest.Count() != 0)
+                        CheckJob(Ids, Rest);
+
+                    return;
+                }
+
+                try {
+                    CApostolModule::QueryToResults(APollQuery, pqResults);
+                } catch (Delphi::Exception::Exception &E) {
+                    // Whatever went wrong, the next poll of these sessions starts over with a full sync.
+                    for (const auto &session : Sessions)
+                        m_Cursors.erase(session.first.c_str());
+                    DoError(E);
+                    return;
+                }
+
+                for (size_t i = 0; i < Sessions.size(); ++i) {
+                    const auto &session = Sessions[i].first;
+                    const auto delta = Sessions[i].second;
+
+                    const auto offset = (int) i * size;
+
+                    try {
+                        const auto &authorize = pqResults[offset + QUERY_INDEX_AUTH].First();
+
+                        if (authorize["authorized"] != "t")
+                            throw Delphi::Exception::ExceptionFrm("Authorization failed: %s", authorize["message"].c_str());
+
+                        if (full) {
+                            const auto &cursor = pqResults[offset + QUERY_INDEX_CURSOR].First();
+
+                            auto &Sync = m_Cursors[session.c_str()];
+
+                            Sync.Cursor = cursor["cursor"];
+                            Sync.Horizon = cursor["horizon"];
+
+                            if (delta)
+                                m_DeltaErrors = 0;
+                        }
+
+                        const auto enumerated = std::chrono::steady_clock::now();
+
+                        EnumJob(session, pqResults[offset + QUERY_INDEX_DATA], Ids, full && !delta);
+
+                        if (m_BenchInterval > 0)
+                            m_Bench.Observe("enum_job", SecondsSince(enumerated));
+                    } catch (Delphi::Exception::Exception &E) {
+                        m_Cursors.erase(session.c_str());
+
+                        if (delta && ++m_DeltaErrors >= 3) {
+                            m_Delta = false;
+                            Log()->Notice("[%s] Incremental sync is disabled after repeated errors", CONFIG_SECTION_NAME);
+                        }
+
+                        DoError(E);
+                    }
+                }
+            };
+
+            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                m_Cursors.clear();
+                DoConnectError(E);
+            };
+
+            CString Filter;
+
+            for (int i = 0; i < Ids.Count(); ++i) {
+                if (i > 0)
+                    Filter << ", ";
+                Filter << PQQuoteLiteral(Ids[i]);
+            }
+
+            CStringList SQL;
+            CSessions Batch;
+
+            for (int i = 0; i < Sessions.Count(); ++i) {
+                const auto &session = Sessions[i];
+
+                const CSyncCursor *pCursor = nullptr;
+
+                if (full && m_Delta) {
+                    const auto it = m_Cursors.find(session.c_str());
+                    if (it != m_Cursors.end())
+                        pCursor = &it->second;
+                }
+
+                // Each session authorizes its own block: the job list below it is read under that session.
+                Authorize(SQL, session);
+                JobList(SQL, Filter, pCursor);
+
+                Batch.emplace_back(session, pCursor != nullptr);
+
+                // With fan-in all sessions share one round trip; otherwise each one is sent on its own.
+                if (!m_FanIn || i == Sessions.Count() - 1) {
+                    try {
+                        ExecPool(m_Control, SQL, [OnEnum, Batch](CPQPollQuery *APollQuery) { OnEnum(APollQuery, Batch); }, OnException);
+                    } catch (Delphi::Exception::Exception &E) {
+                        DoConnectError(E);
+                    }
+
+                    SQL.Clear();
+                    Batch.clear();
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::JobList(CStringList &SQL, const CString &Filter, const CSyncCursor *Cursor) {
+            // "delay" is the time left until daterun by the database clock, in milliseconds (negative when overdue).
+            // Jobs due before the next poll are fetched in advance and wait for their time in the ready queue.
+            const auto ahead = CheckListen() ? m_PollInterval : m_Heartbeat;
+
+            if (Filter.IsEmpty() && m_Prepare && m_CursorColumn == m_PreparedColumn) {
+                if (Cursor != nullptr) {
+                    SQL.Add(CString().Format("EXECUTE " PREPARED_JOB_DELTA "(%d, %s, %s);", ahead,
+                                             PQQuoteLiteral(Cursor->Cursor).c_str(), PQQuoteLiteral(Cursor->Horizon).c_str()));
+                } else {
+                    SQL.Add(CString().Format("EXECUTE " PREPARED_JOB "(%d);", ahead));
+                }
+
+                SQL.Add(CString().Format("EXECUTE " PREPARED_CURSOR "(%d, %d);", DELTA_OVERLAP_SECONDS, ahead));
+
+                return;
+            }
+
+            const CString Window(CString().Format("Now() + %d * interval '1 millisecond'", ahead));
+
+            // "ahead" is false for a changed row that is not due within the window: it is not queued yet.
+            CString Columns("SELECT *, round(extract(epoch FROM daterun - Now()) * 1000)::bigint AS delay, daterun <= ");
+            Columns << Window << " AS ahead";
+
+            CString Query(Columns);
+
+            if (!Filter.IsEmpty()) {
+                // A notified job is read whatever its state: a disabled one has to leave the queue.
+                Query << " FROM api.job WHERE id IN (" << Filter << ")";
+            } else if (Cursor != nullptr) {
+                // Changed since the last sync in any state, entered the look-ahead window since then, or overdue and still not started.
+                Query << " FROM api.job WHERE " << m_CursorColumn << " > " << PQQuoteLiteral(Cursor->Cursor);
+                Query << " UNION ALL " << Columns << " FROM api.job('enabled', " << Window << ")";
+                Query << " WHERE daterun > " << PQQuoteLiteral(Cursor->Horizon) << " OR daterun <= Now()";
+            } else {
+                Query << " FROM api.job('enabled', " << Window << ")";
+            }
+
+            Query << " ORDER BY daterun;";
+
+            SQL.Add(Query);
+
+            if (Filter.IsEmpty()) {
+                // Overlap the cursor with the previous sync: rows of transactions that were still open are picked up next time.
+                SQL.Add(CString().Format("SELECT Now() - interval '%d seconds' AS cursor, Now() + %d * interval '1 millisecond' AS horizon;",
+                                         DELTA_OVERLAP_SECONDS, ahead));
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Authorize(CStringList &SQL, const CString &Session) const {
+            if (m_Prepare && m_AuthCache > 0) {
+                SQL.Add(CString().Format("EXECUTE " PREPARED_AUTH_CACHE "(%s, %d);", PQQuoteLiteral(Session).c_str(), m_AuthCache));
+            } else if (m_Prepare) {
+                SQL.Add(CString().Format("EXECUTE " PREPARED_AUTHORIZE "(%s);", PQQuoteLiteral(Session).c_str()));
+            } else {
+                api::authorize(SQL, Session);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::ExecuteAction(CStringList &SQL, const CString &Id, const CString &Action) const {
+            if (m_Prepare) {
+                SQL.Add(CString().Format("EXECUTE " PREPARED_EXECUTE "(%s, %s);", PQQuoteLiteral(Id).c_str(), PQQuoteLiteral(Action).c_str()));
+            } else {
+                api::execute_object_action(SQL, Id, Action);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::SetLabel(CStringList &SQL, const CString &Id, const CString &Label) const {
+            if (m_Prepare) {
+                SQL.Add(CString().Format("EXECUTE " PREPARED_LABEL "(%s, %s);", PQQuoteLiteral(Id).c_str(), PQQuoteLiteral(Label).c_str()));
+            } else {
+                api::set_object_label(SQL, Id, Label);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Prepare(CPQConnection *AConnection) {
+            const auto ahead = "Now() + $1::integer * interval '1 millisecond'";
+
+            CString Columns;
+            Columns.Format("SELECT *, round(extract(epoch FROM daterun - Now()) * 1000)::bigint AS delay, daterun <= %s AS ahead", ahead);
+
+            CString Job(Columns);
+            Job << " FROM api.job('enabled', " << ahead << ")";
+
+            CString Delta(Columns);
+            Delta << " FROM api.job WHERE " << m_PreparedColumn << " > $2::timestamptz";
+            Delta << " UNION ALL " << Job << " WHERE daterun > $3::timestamptz OR daterun <= Now()";
+
+            Job << " ORDER BY daterun";
+            Delta << " ORDER BY daterun";
+
+            const std::vector<std::pair<LPCTSTR, CString>> Statements = {
+                {PREPARED_AUTHORIZE, "SELECT * FROM api.authorize($1::text)"},
+                {PREPARED_EXECUTE, "SELECT * FROM api.execute_object_action($1::uuid, $2::text)"},
+                {PREPARED_LABEL, "SELECT * FROM api.set_object_label($1::uuid, $2::text)"},
+                {PREPARED_JOB, Job},
+                {PREPARED_JOB_DELTA, Delta},
+                {PREPARED_CURSOR, "SELECT Now() - $1::integer * interval '1 second' AS cursor, "
+                                  "Now() + $2::integer * interval '1 millisecond' AS horizon"}
+            };
+
+            CStringList SQL;
+
+            for (const auto &statement : Statements) {
+                SQL.Add(CString().Format("PREPARE %s AS %s;", statement.first, statement.second.c_str()));
+            }
+
+            const auto count = (int) Statements.size();
+            const auto cache = m_AuthCache > 0;
+
+            if (cache)
+                PrepareAuthCache(SQL);
+
+            // A failed statement ends the batch: the statements after it get no result.
+            auto OnExecuted = [this, count, cache](CPQPollQuery *APollQuery) {
+                const auto total = cache ? count + 3 : count;
+
+                CString error("no result");
+                int i = 0;
+
+                for (; i < APollQuery->Count() && i < total; i++) {
+                    auto pResult = APollQuery->Results(i);
+                    // The authorization cache starts with a probe that returns a row.
+                    const auto status = cache && i == count ? PGRES_TUPLES_OK : PGRES_COMMAND_OK;
+
+                    if (pResult->ExecStatus() != status) {
+                        error = pResult->GetErrorMessage();
+                        break;
+                    }
+                }
+
+                if (i < count) {
+                    // Another connection may lack the statements as well: fall back to plain text for good.
+                    m_Prepare = false;
+                    Log()->Error(APP_LOG_ERR, 0, "[%s] Prepare failed, prepared statements are disabled: %s", CONFIG_SECTION_NAME, error.c_str());
+                    return;
+                }
+
+                if (i < total) {
+                    m_AuthCache = 0;
+                    Log()->Error(APP_LOG_ERR, 0, "[%s] Authorization cache is disabled: %s", CONFIG_SECTION_NAME, error.c_str());
+                }
+
+                Log()->Debug(APP_LOG_DEBUG_CORE, "[%s] Statements prepared on connection %d", CONFIG_SECTION_NAME, PQsocket(APollQuery->Connection()->Handle()));
+            };
+
+            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                m_Prepare = false;
+                Log()->Error(APP_LOG_ERR, 0, "[%s] Prepare failed, prepared statements are disabled: %s", CONFIG_SECTION_NAME, E.what());
+            };
+
+            try {
+                ExecConnection(AConnection, SQL, OnExecuted, OnException);
+            } catch (Delphi::Exception::Exception &E) {
+                OnException(nullptr, E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::PrepareAuthCache(CStringList &SQL) {
+            // The connection remembers the session it authorized and until when. A query for the same session
+            // skips api.authorize while the database still reports that session as current: a login, a signout
+            // or an authorize for another session on this connection changes current_session() and voids the cache.
+            SQL.Add("SELECT current_session();");
+            SQL.Add("CREATE OR REPLACE FUNCTION pg_temp.task_authorize(pSession text, pTTL integer, OUT authorized bool, OUT message text)\n"
+                    "RETURNS record AS $$\n"
+                    "DECLARE\n"
+                    "  vCache text;\n"
+                    "BEGIN\n"
+                    "  vCache := current_setting('task_scheduler.authorized', true);\n"
+                    "  IF coalesce(current_session() = pSession, false) AND coalesce(split_part(vCache, ' ', 1) = pSession, false) THEN\n"
+                    "    IF split_part(vCache, ' ', 2)::double precision > extract(epoch FROM clock_timestamp()) THEN\n"
+                    "      authorized := true;\n"
+                    "      RETURN;\n"
+                    "    END IF;\n"
+                    "  END IF;\n"
+                    "  SELECT a.authorized, a.message INTO authorized, message FROM api.authorize(pSession) a;\n"
+                    "  IF coalesce(authorized, false) THEN\n"
+                    "    PERFORM set_config('task_scheduler.authorized', pSession || ' ' || (extract(epoch FROM clock_timestamp()) + pTTL)::text, false);\n"
+                    "  ELSE\n"
+                    "    PERFORM set_config('task_scheduler.authorized', '', false);\n"
+                    "  END IF;\n"
+                    "END;\n"
+                    "$$ LANGUAGE plpgsql;");
+            SQL.Add("PREPARE " PREPARED_AUTH_CACHE " AS SELECT * FROM pg_temp.task_authorize($1::text, $2::integer);");
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::CheckNotified() {
+            if (m_Status != psRunning || (m_Notified.empty() && !m_NotifiedAll))
+                return;
+
+            // A node that has not heard from its peers yet keeps the notifications for later.
+            if (m_Cluster && Now() < m_JoinDate)
+                return;
+
+            if (m_NotifiedAll) {
+                CheckJob();
+            } else {
+                CStringList Ids;
+                for (const auto &id : m_Notified)
+                    Ids.Add(id.c_str());
+                CheckJob(Ids);
+            }
+
+            // An upstream job finished by another process or node is only seen in the database.
+            CheckDepends();
+
+            m_Notified.clear();
+            m_NotifiedAll = false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::DoFatal(const Delphi::Exception::Exception &E) {
+            m_Metrics.Fatal++;
+
+            m_AuthDate = Now() + (CDateTime) SLEEP_SECOND_AFTER_ERROR / SecsPerDay; // 10 sec;
+            m_CheckDate = m_AuthDate;
+
+            m_Status = psStopped;
+
+            Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
+            Log()->Notice("Continue after %d seconds", SLEEP_SECOND_AFTER_ERROR);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CTaskScheduler::Backoff(CBackoff &Value, int Min, int Max) {
+            // Exponential growth capped at Max, with "equal jitter": half fixed, half random.
+            const auto shift = Value.Attempts < 16 ? Value.Attempts : 16;
+
+            long delay = (long) Min << shift;
+            if (delay > Max)
+                delay = Max;
+
+            if (delay > 1)
+                delay = delay / 2 + random() % (delay / 2 + 1);
+
+            Value.Attempts++;
+            Value.Until = Now() + (CDateTime) delay / MSecsPerDay;
+
+            return (int) delay;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::DoRetry(const CString &Id, const Delphi::Exception::Exception &E) {
+            m_Metrics.Errors++;
+
+            const auto delay = Backoff(m_Retry[Id.c_str()], m_RetryMin, m_RetryMax);
+
+            Log()->Error(APP_LOG_ERR, 0, "[%s] %s", Id.c_str(), E.what());
+            Log()->Notice("[%s] Task will be retried after %d ms", Id.c_str(), delay);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::LaunchFailed(const CJobRef &Job, const Delphi::Exception::Exception &E) {
+            // The body failed inside the "execute" transaction and took it down too: the job is still "enabled"
+            // in the database. It passes "execute" again together with "fail", as a two-step start would have ended.
+            auto pTask = m_Jobs.Find(Job->Id);
+            if (pTask != nullptr) {
+                pTask->Query(nullptr);
+                pTask->State(tsFinish);
+            }
+
+            DoRetry(Job->Id, E);
+            DoTransition(Job, "fail", E.what(), true);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::DoConnectError(const Delphi::Exception::Exception &E) {
+            m_Metrics.Errors++;
+
+            const auto delay = Backoff(m_Reconnect, m_HeartbeatInterval, m_ReconnectMax);
+
+            // Jobs already in flight keep running; only polling waits for the connection to come back.
+            if (m_CheckDate < m_Reconnect.Until)
+                m_CheckDate = m_Reconnect.Until;
+
+            m_Cursors.clear();
+
+            Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
+            Log()->Notice("Polling continues after %d ms", delay);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::DoError(const Delphi::Exception::Exception &E) {
+            m_Metrics.Errors++;
+            Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Heartbeat(CDateTime Now) {
+            if ((Now >= m_AuthDate)) {
+                m_AuthDate = Now + (CDateTime) 5 / SecsPerDay; // 5 sec
+                Authentication();
+            }
+
+            if (m_Status == psRunning) {
+                const auto listen = CheckListen();
+
+                if (m_Notify && !listen && (Now >= m_ListenDate)) {
+                    m_ListenDate = Now + (CDateTime) 5 / SecsPerDay; // 5 sec
+                    InitListen();
+                }
+
+                if (m_Cluster && listen)
+                    Membership(Now);
+
+                // A cluster node claims jobs only while it can see its peers.
+                if ((Now >= m_CheckDate) && (!m_Cluster || (listen && Now >= m_JoinDate))) {
+                    // A round that brought nothing to do slows the next one down, up to "heartbeat_max".
+                    if (m_Idle && m_Heartbeat < m_HeartbeatMax) {
+                        m_Heartbeat = m_Heartbeat > m_HeartbeatMax / 2 ? m_HeartbeatMax : m_Heartbeat * 2;
+                        Log()->Debug(APP_LOG_DEBUG_CORE, "[%s] Idle, heartbeat is %d ms", CONFIG_SECTION_NAME, m_Heartbeat);
+                    }
+
+                    m_Idle = true;
+
+                    // The backoff of a job that never came back to the list (deleted or disabled) is forgotten:
+                    // a job still failing is queued again within a poll of its retry time.
+                    const auto keep = (CDateTime) (m_PollInterval > m_RetryMax ? m_PollInterval : m_RetryMax) / MSecsPerDay;
+                    for (auto it = m_Retry.begin(); it != m_Retry.end();) {
+                        if (it->second.Until + keep < Now && m_Jobs.Find(it->first.c_str()) == nullptr) {
+                            it = m_Retry.erase(it);
+                        } else {
+                            ++it;
+                        }
+                    }
+
+                    // While notifications are delivered, polling is only a safety net for missed ones.
+                    m_CheckDate = Now + (CDateTime) (listen ? m_PollInterval : m_Heartbeat) / MSecsPerDay;
+                    CheckJob();
+                    CheckDepends();
+                }
+            }
+
+            if (m_BenchInterval > 0 && Now >= m_BenchDate)
+                Benchmark(Now);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Benchmark(CDateTime Now) {
+            CString Report;
+
+            m_Bench.Report(Report, Now, m_Metrics.Started, m_Metrics.Finished);
+            m_Bench.Reset(Now, m_Metrics.Started, m_Metrics.Finished);
+
+            m_BenchDate = Now + (CDateTime) m_BenchInterval / MSecsPerDay;
+
+            Log()->Notice("[%s] Benchmark\n%s", CONFIG_SECTION_NAME, Report.c_str());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Announce(bool Join) {
+
+            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+                DoPostgresQueryExecuted(APollQuery);
+            };
+
+            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoError(E);
+            };
+
+            m_AnnounceDate = Now() + (CDateTime) m_Lease / 3 / MSecsPerDay;
+
+            // "+node" asks the peers to answer right away, "node" only renews the lease.
+            CString payload(Join ? "+" : "");
+            payload << m_Node;
+
+            CString Query("SELECT pg_notify(");
+            Query << PQQuoteLiteral(m_ClusterChannel) << ", " << PQQuoteLiteral(payload) << ");";
+
+            CStringList SQL;
+            SQL.Add(Query);
+
+            try {
+                ExecPool(m_Control, SQL, OnExecuted, OnException);
+            } catch (Delphi::Exception::Exception &E) {
+                DoConnectError(E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::NodeSeen(const CString &Payload) {
+            const auto join = !Payload.IsEmpty() && Payload.c_str()[0] == '+';
+            const CString node(join ? Payload.c_str() + 1 : Payload.c_str());
+
+            if (node.IsEmpty() || node == m_Node)
+                return;
+
+            const auto known = m_Nodes.count(node.c_str()) != 0;
+
+            m_Nodes[node.c_str()] = Now() + (CDateTime) m_Lease / MSecsPerDay;
+
+            if (join)
+                m_AnnounceDate = 0;
+
+            if (!known) {
+                Log()->Notice("[%s] Node \"%s\" joined the cluster", CONFIG_SECTION_NAME, node.c_str());
+                Rebalance();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Membership(CDateTime Now) {
+            if (Now >= m_AnnounceDate)
+                Announce(false);
+
+            auto changed = false;
+
+            for (auto it = m_Nodes.begin(); it != m_Nodes.end();) {
+                if (it->second < Now) {
+                    Log()->Notice("[%s] Node \"%s\" lease expired", CONFIG_SECTION_NAME, it->first.c_str());
+                    it = m_Nodes.erase(it);
+                    changed = true;
+                } else {
+                    ++it;
+                }
+            }
+
+            if (changed)
+                Rebalance();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Rebalance() {
+            // Queued jobs that now belong to a peer are handed over; running jobs are finished here.
+            CStringList Moved;
+
+            for (int i = 0; i < m_Jobs.Count(); ++i) {
+                const auto pTask = m_Jobs.Tasks(i);
+                if (pTask->State() == tsQueue && !Owned(pTask->Id()))
+                    Moved.Add(pTask->Id());
+            }
+
+            for (int i = 0; i < Moved.Count(); ++i) {
+                DeleteJob(Moved[i]);
+            }
+
+            // The next poll is a full sync: jobs taken over may not have changed since the last cursor.
+            m_Cursors.clear();
+            m_CheckDate = 0;
+
+            Log()->Notice("[%s] Cluster of %d nodes, %d queued jobs handed over", CONFIG_SECTION_NAME,
+                          (int) m_Nodes.size() + 1, Moved.Count());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CTaskScheduler::Weight(const CString &Node, const CString &Id) {
+            // FNV-1a: unlike std::hash, the same on every node.
+            uint64_t hash = 14695981039346656037ULL;
+
+            for (const auto pValue : {&Node, &Id}) {
+                for (auto p = pValue->c_str(); *p != '\0'; ++p) {
+                    hash ^= (unsigned char) *p;
+                    hash *= 1099511628211ULL;
+                }
+                hash ^= 0xff;
+                hash *= 1099511628211ULL;
+            }
+
+            return hash;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTaskScheduler::Owned(const CString &Id) const {
+            if (!m_Cluster)
+                return true;
+
+            // Rendezvous hashing: the node with the highest weight owns the job,
+            // and a node that joins or leaves moves only its own share of jobs.
+            const auto weight = Weight(m_Node, Id);
+
+            for (const auto &node : m_Nodes) {
+                const auto peer = Weight(node.first.c_str(), Id);
+                if (peer > weight || (peer == weight && node.first > m_Node.c_str()))
+                    return false;
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTaskScheduler::Orphaned(const CString &Owner) const {
+            // A job started by this node, by a node that is gone or by an unknown one.
+            return Owner.IsEmpty() || Owner == m_Node || m_Nodes.count(Owner.c_str()) == 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::ScheduleTimer() {
+            const auto now = Now();
 
-    namespace Processes {
+            // An idle process wakes up only for its next poll.
+            auto next = now + (CDateTime) m_PollInterval / MSecsPerDay;
+
+            if (m_AuthDate < next)
+                next = m_AuthDate;
+
+            if (m_BenchInterval > 0 && m_BenchDate < next)
+                next = m_BenchDate;
+
+            if (m_Status == psRunning) {
+                if (m_CheckDate < next)
+                    next = m_CheckDate;
+
+                if (m_Notify && !CheckListen() && m_ListenDate < next)
+                    next = m_ListenDate;
+
+                if (!m_Deadlines.empty() && m_Deadlines.top().first < next)
+                    next = m_Deadlines.top().first;
+
+                // SIGCHLD interrupts the wait, so a finished child is reaped on the next cycle; the poll is a safety net.
+                for (auto pExecutor : m_Executors) {
+                    if (pExecutor->Count() != 0) {
+                        const auto poll = now + (CDateTime) EXECUTOR_POLL_INTERVAL / MSecsPerDay;
+                        if (poll < next)
+                            next = poll;
+                        break;
+                    }
+                }
+
+                if (m_Cluster && CheckListen() && m_AnnounceDate < next)
+                    next = m_AnnounceDate;
+
+                if (m_RateDate != 0 && m_RateDate < next)
+                    next = m_RateDate;
+
+                // Due jobs still in the queue are waiting for a slot and are started on completion,
+                // so the timer is armed for the first job that is not due yet.
+                for (const auto &job : m_Ready) {
+                    if (job.Due > now) {
+                        if (job.Due < next)
+                            next = job.Due;
+                        break;
+                    }
+                }
+            }
+
+            auto interval = (int) ((next - now) * MSecsPerDay);
+            if (interval < 1)
+                interval = 1;
 
+            SetTimerInterval(interval);
+        }
         //--------------------------------------------------------------------------------------------------------------
 
-        //-- CTaskScheduler --------------------------------------------------------------------------------------------
+        void CTaskScheduler::DoTimer(CPollEventHandler *AHandler) {
+            uint64_t exp;
 
+            auto pTimer = dynamic_cast<CEPollTimer *> (AHandler->Binding());
+            pTimer->Read(&exp, sizeof(uint64_t));
+
+            try {
+                Heartbeat(AHandler->TimeStamp());
+            } catch (Delphi::Exception::Exception &E) {
+                DoServerEventHandlerException(AHandler, E);
+            }
+        }
         //--------------------------------------------------------------------------------------------------------------
 
-        CTaskScheduler::CTaskScheduler(CCustomProcess *AParent, CApplication *AApplication):
-                inherited(AParent, AApplication, "task scheduler") {
+        void CTaskScheduler::Activity() {
+            m_Idle = false;
 
-            m_Agent = CString().Format("%s (%s)", GApplication->Title().c_str(), ProcessName().c_str());
-            m_Host = CApostolModule::GetIPByHostName(CApostolModule::GetHostName());
+            if (m_Heartbeat == m_HeartbeatInterval)
+                return;
 
-            m_AuthDate = 0;
-            m_CheckDate = 0;
+            m_Heartbeat = m_HeartbeatInterval;
 
-            m_HeartbeatInterval = 1000;
-            m_Status = psStopped;
+            // The poll that was pushed out by the idle backoff is pulled back in.
+            const auto next = Now() + (CDateTime) m_Heartbeat / MSecsPerDay;
+            if (!CheckListen() && m_CheckDate > next)
+                m_CheckDate = next;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::BeforeRun() {
-            Application()->Header(Application()->Name() + ": task scheduler");
+        void CTaskScheduler::Trace(const CString &Id, const CString &Action) {
+            if (!m_Tracer.Active())
+                return;
 
-            Log()->Debug(APP_LOG_DEBUG_CORE, MSG_PROCESS_START, GetProcessName(), Application()->Header().c_str());
+            const auto pTask = m_Jobs.Find(Id);
+            if (pTask != nullptr)
+                m_Tracer.Write(pTask, Action, Now());
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            InitSignals();
+        void CTaskScheduler::DeleteJob(const CString &Id) {
+            auto pTask = m_Jobs.Find(Id);
+            if (pTask == nullptr)
+                return;
+
+            if (pTask->State() == tsQueue) {
+                if (!m_Ready.Remove(Id))
+                    m_Blocked.erase(Id.c_str());
+            } else {
+                Release(pTask->TypeCode());
+            }
 
-            Reload();
+            m_Jobs.Delete(Id);
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            SetUser(Config()->User(), Config()->Group());
+        CJobRef CTaskScheduler::NewJob(const CString &Session, const CString &Id) {
+            auto job = m_JobPool.Get();
 
-            InitializePQClients(Application()->Title(), 1, Config()->PostgresPollMin());
+            job->Session = Session;
+            job->Id = Id;
 
-            SigProcMask(SIG_UNBLOCK);
+            return job;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Enqueue(const CString &Session, const CString &Id, const CString &TypeCode, const CString &Body, const CString &DateRun,
+                                     CDateTime Due, bool Missed, bool Skip) {
+            if (m_Ready.Contains(Id))
+                return;
+
+            // The only copy of the job: the queue, the registry and every query callback share it from here on.
+            auto job = NewJob(Session, Id);
+
+            job->TypeCode = TypeCode;
+            job->Body = Body;
+            job->DateRun = DateRun;
+            job->Missed = Missed;
+            job->Skip = Skip;
+
+            m_Ready.Push(job, Due);
 
-            SetTimerInterval(1000);
+            auto pTask = m_Jobs.Add(job);
+
+            pTask->State(tsQueue);
+            pTask->EnumDate(Now());
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::AfterRun() {
-            CApplicationProcess::AfterRun();
-            PQClientsStop();
+        CTokenBucket *CTaskScheduler::SessionBucket(const CString &Session) {
+            if (m_SessionRates.empty())
+                return nullptr;
+
+            const std::string session(Session.c_str());
+
+            auto it = m_SessionBuckets.find(session);
+            if (it == m_SessionBuckets.end()) {
+                // "*" is the rate of every session not listed on its own.
+                auto rate = m_SessionRates.find(session);
+                if (rate == m_SessionRates.end())
+                    rate = m_SessionRates.find("*");
+                if (rate == m_SessionRates.end())
+                    return nullptr;
+
+                it = m_SessionBuckets.emplace(session, rate->second).first;
+            }
+
+            return &it->second;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        bool CTaskScheduler::InProgress(const CString &Id) {
-            return m_Jobs.IndexOf(Id) != -1;
+        bool CTaskScheduler::Admit(const CJobContext &Job, CDateTime Now) {
+            CDateTime next = 0;
+
+            const auto type = m_TypeRates.find(Job.TypeCode.c_str());
+            if (type != m_TypeRates.end() && !type->second.Ready(Now))
+                next = type->second.Next(Now);
+
+            auto pSession = SessionBucket(Job.Session);
+            if (pSession != nullptr && !pSession->Ready(Now)) {
+                const auto date = pSession->Next(Now);
+                if (date > next)
+                    next = date;
+            }
+
+            if (next == 0)
+                return true;
+
+            // The timer wakes up for the earliest token that lets some deferred job go.
+            if (m_RateDate == 0 || next < m_RateDate)
+                m_RateDate = next;
+
+            return false;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::Run() {
-            auto &PQClient = PQClientStart("helper");
+        void CTaskScheduler::Charge(const CJobContext &Job, CDateTime Now) {
+            const auto type = m_TypeRates.find(Job.TypeCode.c_str());
+            if (type != m_TypeRates.end())
+                type->second.Take(Now);
 
-            while (!sig_exiting) {
+            auto pSession = SessionBucket(Job.Session);
+            if (pSession != nullptr)
+                pSession->Take(Now);
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                Log()->Debug(APP_LOG_DEBUG_EVENT, _T("task scheduler cycle"));
+        bool CTaskScheduler::Acquire(const CString &TypeCode) {
+            if (m_Active >= m_MaxJobs)
+                return false;
 
-                try {
-                    PQClient.Wait();
-                } catch (Delphi::Exception::Exception &E) {
-                    Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
+            const std::string type_code(TypeCode.c_str());
+
+            const auto limit = m_TypeLimits.find(type_code);
+            if (limit != m_TypeLimits.end() && m_TypeActive[type_code] >= limit->second)
+                return false;
+
+            m_Active++;
+            m_TypeActive[type_code]++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Release(const CString &TypeCode) {
+            if (m_Active > 0)
+                m_Active--;
+
+            auto it = m_TypeActive.find(TypeCode.c_str());
+            if (it != m_TypeActive.end() && it->second > 0)
+                it->second--;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::Dispatch() {
+            if (m_Status != psRunning)
+                return;
+
+            const auto now = Now();
+            const auto dispatched = std::chrono::steady_clock::now();
+
+            int started = 0;
+            bool blocked = false;
+
+            // Types and sessions found over their rate or limit in this pass: their other jobs are passed over
+            // with one lookup, so a capped backlog does not cost a bucket check per job on every iteration.
+            std::unordered_set<std::string> Types;
+            std::unordered_set<std::string> Sessions;
+
+            m_RateDate = 0;
+
+            auto it = m_Ready.begin();
+            while (it != m_Ready.end() && m_Active < m_MaxJobs) {
+                // The queue is ordered by due time: nothing past this point is due yet.
+                if (it->Due > now)
+                    break;
+
+                // A job waiting for its upstream leaves the queue until a completion releases it.
+                if (!Satisfied(*it)) {
+                    Log()->Debug(APP_LOG_DEBUG_CORE, "[%s] Task is waiting for its dependencies.", it->Job->Id.c_str());
+                    m_Blocked.emplace(it->Job->Id.c_str(), *it);
+                    it = m_Ready.Erase(it);
+                    blocked = true;
+                    continue;
                 }
 
-                if (sig_terminate || sig_quit) {
-                    if (sig_quit) {
-                        sig_quit = 0;
-                        Log()->Debug(APP_LOG_DEBUG_EVENT, _T("gracefully shutting down"));
-                        Application()->Header(_T("task scheduler is shutting down"));
-                    }
+                const std::string type_code(it->Job->TypeCode.c_str());
+                const std::string session(it->Job->Session.c_str());
 
-                    if (!sig_exiting) {
-                        sig_exiting = 1;
-                    }
+                if (Types.count(type_code) != 0 || Sessions.count(session) != 0) {
+                    ++it;
+                    continue;
                 }
 
-                if (sig_reconfigure) {
-                    sig_reconfigure = 0;
-                    Log()->Debug(APP_LOG_DEBUG_EVENT, _T("reconfiguring"));
+                // Over its rate a job is deferred to the next token, not failed; the slot stays free for others.
+                if (!Admit(*it->Job, now)) {
+                    const auto type = m_TypeRates.find(type_code);
+                    if (type != m_TypeRates.end() && !type->second.Ready(now))
+                        Types.insert(type_code);
 
-                    Reload();
+                    const auto pSession = SessionBucket(it->Job->Session);
+                    if (pSession != nullptr && !pSession->Ready(now))
+                        Sessions.insert(session);
+
+                    ++it;
+                    continue;
                 }
 
-                if (sig_reopen) {
-                    sig_reopen = 0;
-                    Log()->Debug(APP_LOG_DEBUG_EVENT, _T("reopening logs"));
+                // Jobs of a saturated type keep their place; the next type in order may still fit.
+                if (!Acquire(it->Job->TypeCode)) {
+                    Types.insert(type_code);
+                    ++it;
+                    continue;
                 }
-            }
 
-            Log()->Debug(APP_LOG_DEBUG_EVENT, _T("stop task scheduler"));
-        }
-        //--------------------------------------------------------------------------------------------------------------
+                Charge(*it->Job, now);
 
-        void CTaskScheduler::Reload() {
-            CServerProcess::Reload();
+                const auto job = it->Job;
+                const auto due = it->Due;
 
-            m_Sessions.Clear();
-            m_Jobs.Clear();
+                it = m_Ready.Erase(it);
 
-            m_AuthDate = 0;
-            m_CheckDate = 0;
+                auto pTask = m_Jobs.Find(job->Id);
+                if (pTask != nullptr) {
+                    pTask->State(tsStart);
+                    pTask->Due(due);
+                }
 
-            m_Status = psStopped;
+                // An external executor cannot join the "execute" transaction, so its jobs are started in two steps.
+                // So is a skipped run: it has no body to send along.
+                if (m_Pipeline && !job->Skip && Executor(job->TypeCode) == nullptr) {
+                    DoLaunch(job);
+                } else {
+                    DoStart(job);
+                }
 
-            Log()->Notice("[%s] Successful reloading", CONFIG_SECTION_NAME);
+                started++;
+            }
+
+            // Only rounds that started something: idle wake-ups would drown the numbers.
+            if (blocked)
+                CheckDepends();
+
+            if (started > 0 && m_BenchInterval > 0)
+                m_Bench.Observe("dispatch", SecondsSince(dispatched));
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::Authentication() {
+        void CTaskScheduler::DoRun(const CJobRef &Job) {
 
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+            if (Job->Skip) {
+                auto pTask = m_Jobs.Find(Job->Id);
+                if (pTask != nullptr)
+                    pTask->State(tsFinish);
 
-                CPQueryResults pqResults;
+                Log()->Message("[%s] Missed run skipped.", Job->Id.c_str());
 
-                CStringList SQL;
+                DoDone(Job);
+                return;
+            }
 
+            auto pExecutor = Executor(Job->TypeCode);
+            if (pExecutor != nullptr) {
                 try {
-                    CApostolModule::QueryToResults(APollQuery, pqResults);
+                    pExecutor->Start(Job);
+                    JobStarted(Job->Id, nullptr);
+                    m_Journal.Start(Job->Id, CJournal::jmExecutor);
+                    Log()->Message("[%s] Task started by an executor.", Job->Id.c_str());
+                } catch (Delphi::Exception::Exception &E) {
+                    // "execute" is already committed: the job has to fail in the database as well.
+                    auto pTask = m_Jobs.Find(Job->Id);
+                    if (pTask != nullptr)
+                        pTask->State(tsFinish);
+                    DoFail(Job, E.what());
+                }
+                return;
+            }
 
-                    const auto &login = pqResults[0];
-                    const auto &sessions = pqResults[1];
+            auto OnExecuted = [this, Job](CPQPollQuery *APollQuery) {
 
-                    const auto &session = login.First()["session"];
+                const auto &id = Job->Id;
 
-                    m_Sessions.Clear();
-                    for (int i = 0; i < sessions.Count(); ++i) {
-                        m_Sessions.Add(sessions[i]["get_sessions"]);
-                    }
+                if (Finishing(id))
+                    return;
 
-                    m_AuthDate = Now() + (CDateTime) 24 / HoursPerDay;
-                    m_Status = psRunning;
+                CPQResult *pResult;
+                try {
+                    for (int i = 0; i < APollQuery->Count(); i++) {
+                        pResult = APollQuery->Results(i);
 
-                    SignOut(session);
+                        if (pResult->ExecStatus() != PGRES_TUPLES_OK)
+                            throw Delphi::Exception::EDBError(pResult->GetErrorMessage());
+                    }
+
+                    JobExecuted(Job);
                 } catch (Delphi::Exception::Exception &E) {
-                    DoFatal(E);
+                    DeleteJob(id);
+                    DoRetry(id, E);
                 }
             };
 
-            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                DoFatal(E);
-            };
+            auto OnException = [this, Job](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                const auto &id = Job->Id;
 
-            const auto &caProviders = Server().Providers();
-            const auto &caProvider = caProviders.DefaultValue();
+                if (Finishing(id))
+                    return;
 
-            const auto &clientId = caProvider.ClientId(SERVICE_APPLICATION_NAME);
-            const auto &clientSecret = caProvider.Secret(SERVICE_APPLICATION_NAME);
+                DeleteJob(id);
+                DoRetry(id, E);
+            };
 
             CStringList SQL;
 
-            api::login(SQL, clientId, clientSecret, m_Agent, m_Host);
-            api::get_sessions(SQL, API_BOT_USERNAME, m_Agent, m_Host);
+            Authorize(SQL, Job->Session);
+            SQL.Add(Job->Body);
+
+            Log()->Message("[%s] Task started.", Job->Id.c_str());
 
             try {
-                ExecSQL(SQL, nullptr, OnExecuted, OnException);
+                auto pQuery = ExecPool(m_Execution, SQL, OnExecuted, OnException);
+                JobStarted(Job->Id, pQuery);
+                m_Journal.Start(Job->Id, CJournal::jmTwoStep);
             } catch (Delphi::Exception::Exception &E) {
-                DoFatal(E);
+                DeleteJob(Job->Id);
+                DoConnectError(E);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::SignOut(const CString &Session) {
-            CStringList SQL;
+        void CTaskScheduler::JobStarted(const CString &Id, CPQQuery *AQuery) {
+            auto pTask = m_Jobs.Find(Id);
+            if (pTask == nullptr)
+                return;
 
-            api::signout(SQL, Session);
+            const auto now = Now();
 
-            try {
-                ExecSQL(SQL);
-            } catch (Delphi::Exception::Exception &E) {
-                DoFatal(E);
+            pTask->Query(AQuery);
+            pTask->State(tsRun);
+            pTask->RunDate(now);
+
+            const auto timeout = Timeout(Id, pTask->TypeCode());
+            if (timeout > 0) {
+                pTask->Deadline(now + (CDateTime) timeout / MSecsPerDay);
+                m_Deadlines.push({pTask->Deadline(), Id.c_str()});
+            }
+
+            if (pTask->Due() > 0)
+                m_Metrics.StartLatency.Observe((now - pTask->Due()) * SecsPerDay);
+
+            if (m_BenchInterval > 0 && pTask->Due() > 0)
+                m_Bench.Observe("latency", (now - pTask->Due()) * SecsPerDay);
+
+            m_Metrics.Started++;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CTaskScheduler::Timeout(const CString &Id, const CString &TypeCode) const {
+            auto it = m_Timeouts.find(Id.c_str());
+            if (it == m_Timeouts.end())
+                it = m_Timeouts.find(TypeCode.c_str());
+            return it == m_Timeouts.end() ? m_Timeout : it->second;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTaskScheduler::ParseMisfire(const CString &Value, CMisfirePolicy &Policy) {
+            if (Value == "all") {
+                Policy = mpAll;
+            } else if (Value == "once") {
+                Policy = mpOnce;
+            } else if (Value == "skip") {
+                Policy = mpSkip;
+            } else {
+                return false;
+            }
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CMisfirePolicy CTaskScheduler::MisfirePolicy(const CString &Id, const CString &TypeCode) const {
+            auto it = m_MisfirePolicies.find(Id.c_str());
+            if (it == m_MisfirePolicies.end())
+                it = m_MisfirePolicies.find(TypeCode.c_str());
+            return it == m_MisfirePolicies.end() ? m_MisfirePolicy : it->second;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTaskScheduler::Misfired(const CString &Id, const CString &TypeCode, long long Delay, CDateTime &Due, bool &Skip) {
+            Skip = false;
+
+            // Only a periodic job has a next slot to move on to: any other overdue job is still owed its run.
+            if (TypeCode != "periodic.job")
+                return false;
+
+            // A run is missed when it is overdue by more than "misfire"; a job back on time starts a new series.
+            if (m_Misfire <= 0 || -Delay <= m_Misfire) {
+                m_Misfired.erase(Id.c_str());
+                return false;
+            }
+
+            // The database moves a periodic job on one period at a time, so each missed run comes back overdue.
+            // "once" counts a run only when its "done" is confirmed: a failed catch-up run is retried with its body.
+            auto &Series = m_Misfired[Id.c_str()];
+            if (Series.Start == 0)
+                Series.Start = Now();
+
+            switch (MisfirePolicy(Id, TypeCode)) {
+                case mpOnce:
+                    Skip = Series.Done;
+                    break;
+                case mpSkip:
+                    Skip = true;
+                    break;
+                default:
+                    break;
+            }
+
+            // The backlog is spread over the catch-up window by job id, counted from the start of the series:
+            // the first missed run waits for its offset, the rest of the series runs as soon as it is due.
+            if (!Skip && m_CatchUp > 0) {
+                const auto start = Series.Start + (CDateTime) (Weight(CString(), Id) % (uint64_t) m_CatchUp) / MSecsPerDay;
+                if (start > Due)
+                    Due = start;
             }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTaskScheduler::Finishing(const CString &Id) {
+            // Timed out or canceled while its body was running: the result of the body no longer matters.
+            auto pTask = m_Jobs.Find(Id);
+            if (pTask == nullptr || (pTask->State() != tsTimeout && pTask->State() != tsFinish))
+                return false;
+
+            // The "fail" or "abort" transition is already on its way and will release the job.
+            pTask->Query(nullptr);
+
+            return true;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::EnumJob(const CString &Session, const CPQueryResult &List) {
-            int index;
+        void CTaskScheduler::CheckTimeout() {
+            if (m_Deadlines.empty())
+                return;
+
+            const auto now = Now();
+
             CString Error;
 
-            for (int row = 0; row < List.Count(); ++row) {
-                const auto &job = List[row];
+            while (!m_Deadlines.empty() && m_Deadlines.top().first <= now) {
+                const auto deadline = m_Deadlines.top();
+                m_Deadlines.pop();
 
-                const auto &id = job["id"];
-                const auto &type_code = job["typecode"];
-                const auto &state_code = job["statecode"];
-                const auto &body = job["body"];
+                const CString id(deadline.second.c_str());
 
-                index = m_Jobs.IndexOf(id);
-                if (index != -1) {
-                    if (state_code == "canceled") {
-                        auto pQuery = dynamic_cast<CPQQuery *> (m_Jobs.Objects(index));
-                        if (pQuery != nullptr) {
-                            if (pQuery->CancelQuery(Error)) {
-                                DoAbort(Session, id);
-                            } else {
-                                DoFail(Session, id, Error);
-                            }
-                        }
-                    }
-                } else {
-                    if (state_code == "enabled" || state_code == "aborted" || state_code == "failed") {
-                        DoStart(Session, id, type_code, body);
-                    } else if (state_code == "executed") {
-                        DoCancel(Session, id);
-                    } else if (state_code == "canceled") {
-                        DoAbort(Session, id);
+                // Finished jobs leave their deadlines behind: skip those that no longer match a running task.
+                auto pTask = m_Jobs.Find(id);
+                if (pTask == nullptr || pTask->State() != tsRun || pTask->Deadline() != deadline.first)
+                    continue;
+
+                const auto label = CString().Format("Timeout: execution exceeded %d sec.",
+                                                    Timeout(id, pTask->TypeCode()) / 1000);
+
+                pTask->State(tsTimeout);
+
+                auto pQuery = pTask->Query();
+                if (pQuery != nullptr && !pQuery->CancelQuery(Error)) {
+                    Log()->Error(APP_LOG_ERR, 0, "[%s] Cancel query failed: %s", id.c_str(), Error.c_str());
+                }
+
+                m_Metrics.Timeouts++;
+
+                Log()->Notice("[%s] %s", id.c_str(), label.c_str());
+
+                const auto pExecutor = Executor(pTask->TypeCode());
+                if (pExecutor != nullptr)
+                    pExecutor->Cancel(id);
+
+                // A pipelined start was rolled back with the body, so the job has to pass "execute" first.
+                DoTransition(pTask->Job(), "fail", label, pTask->Pipelined());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTaskScheduler::Satisfied(const CReadyJob &Job) const {
+            if (m_Depends.empty())
+                return true;
+
+            auto it = m_Depends.find(Job.Job->Id.c_str());
+            if (it == m_Depends.end())
+                it = m_Depends.find(Job.Job->TypeCode.c_str());
+            if (it == m_Depends.end())
+                return true;
+
+            // The database is asked after the job fell due: an upstream run due at the same time is seen as pending.
+            if (m_PendingDate < Job.Due)
+                return false;
+
+            // The previous run of this job, as the time its row last changed; unknown is "never".
+            const auto last = m_LastRun.find(Job.Job->Id.c_str());
+            const auto previous = last == m_LastRun.end() ? 0 : last->second;
+
+            // Every upstream job (by id or type code) must have finished since then and not be due, running or failed again.
+            for (const auto &upstream : it->second) {
+                if (m_Pending.count(upstream) != 0)
+                    return false;
+
+                // An upstream job that is not in the database any more has nothing left to wait for.
+                const auto finished = m_Finished.find(upstream);
+                if (finished != m_Finished.end() && finished->second <= previous)
+                    return false;
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::CheckDepends() {
+            CheckDepends(m_Sessions);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::CheckDepends(const CStringList &Sessions) {
+            if (m_Upstream.empty() || m_Blocked.empty() || Sessions.Count() == 0)
+                return;
+
+            // One check at a time: a request made meanwhile is sent as soon as the answer is in.
+            if (m_PendingCheck) {
+                m_PendingAgain = true;
+                return;
+            }
+
+            const auto sent = Now();
+
+            auto OnExecuted = [this, sent, Sessions](CPQPollQuery *APollQuery) {
+                CPQueryResults pqResults;
+
+                m_PendingCheck = false;
+
+                // As in CheckJob: a failed block aborts the ones after it, so the other sessions are asked again without it.
+                const auto total = Sessions.Count() * 2;
+
+                int failed = 0;
+                CString error("no result");
+
+                for (; failed < APollQuery->Count() && failed < total; ++failed) {
+                    const auto pResult = APollQuery->Results(failed);
+                    if (pResult->ExecStatus() != PGRES_TUPLES_OK) {
+                        error = pResult->GetErrorMessage();
+                        break;
                     }
                 }
-            }
-        }
-        //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::CheckJob() {
+                if (failed < total) {
+                    const auto block = failed / 2;
 
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+                    CStringList Rest;
+                    for (int i = 0; i < Sessions.Count(); ++i) {
+                        if (i != block)
+                            Rest.Add(Sessions[i]);
+                    }
 
-                CPQueryResults pqResults;
-                CStringList SQL;
+                    DoError(Delphi::Exception::ExceptionFrm("Session \"%s\": %s", Sessions[block].c_str(), error.c_str()));
 
-                const auto &session = APollQuery->Data()["session"];
+                    m_PendingAgain = false;
+                    CheckDepends(Rest);
+
+                    return;
+                }
 
                 try {
                     CApostolModule::QueryToResults(APollQuery, pqResults);
 
-                    const auto &authorize = pqResults[QUERY_INDEX_AUTH].First();
+                    std::unordered_set<std::string> Pending;
+                    std::unordered_set<std::string> Running;
+                    std::unordered_map<std::string, double> Finished;
+                    std::unordered_map<std::string, double> LastRun;
+
+                    // Authorization and the rows of every session in turn: pending upstream rows first, then
+                    // every upstream and blocked row with the time it last changed.
+                    for (int i = 0; i < Sessions.Count(); ++i) {
+                        const auto &rows = pqResults[i * 2 + 1];
+
+                        for (int row = 0; row < rows.Count(); ++row) {
+                            const std::string id(rows[row]["id"].c_str());
+                            const std::string type_code(rows[row]["typecode"].c_str());
+
+                            if (rows[row]["pending"] == "t") {
+                                Running.insert(id);
+                                if (m_Upstream.count(id) != 0)
+                                    Pending.insert(id);
+                                if (m_Upstream.count(type_code) != 0)
+                                    Pending.insert(type_code);
+                                continue;
+                            }
+
+                            const auto changed = strtod(rows[row]["changed"].c_str(), nullptr);
+
+                            if (m_Blocked.count(id) != 0)
+                                LastRun[id] = changed;
+
+                            // A row that is pending again has not finished its current run.
+                            if (Running.count(id) != 0)
+                                continue;
 
-                    if (authorize["authorized"] != "t")
-                        throw Delphi::Exception::ExceptionFrm("Authorization failed: %s", authorize["message"].c_str());
+                            for (const auto &key : {id, type_code}) {
+                                if (m_Upstream.count(key) == 0)
+                                    continue;
+                                auto &date = Finished[key];
+                                if (changed > date)
+                                    date = changed;
+                            }
+                        }
+                    }
+
+                    m_Pending.swap(Pending);
+                    m_Finished.swap(Finished);
+                    m_LastRun.swap(LastRun);
+                    m_PendingDate = sent;
 
-                    EnumJob(session, pqResults[QUERY_INDEX_DATA]);
+                    Unblock();
                 } catch (Delphi::Exception::Exception &E) {
                     DoError(E);
                 }
+
+                if (m_PendingAgain) {
+                    m_PendingAgain = false;
+                    CheckDepends();
+                }
             };
 
             auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                DoFatal(E);
+                m_PendingCheck = false;
+                m_PendingAgain = false;
+                DoError(E);
             };
 
-            for (int i = 0; i < m_Sessions.Count(); ++i) {
-                const auto &session = m_Sessions[i];
+            CString Names;
+            for (const auto &upstream : m_Upstream) {
+                if (!Names.IsEmpty())
+                    Names << ", ";
+                Names << PQQuoteLiteral(upstream.c_str());
+            }
 
-                CStringList SQL;
+            CString Ids(Names);
+            for (const auto &blocked : m_Blocked) {
+                Ids << ", " << PQQuoteLiteral(blocked.first.c_str());
+            }
 
-                api::authorize(SQL, session);
-                api::job(SQL, "enabled");
+            // Due, running or failed: whatever api.job('enabled', Now()) still lists has not finished its run.
+            // Any other row has finished its last run when it last changed: a completion moves it on or closes it.
+            CString Query;
+            Query << "SELECT id, typecode, true AS pending, 0::double precision AS changed FROM api.job('enabled', Now())";
+            Query << " WHERE id::text IN (" << Names << ") OR typecode IN (" << Names << ")";
+            Query << " UNION ALL SELECT id, typecode, false, extract(epoch FROM " << m_CursorColumn << ")::double precision FROM api.job";
+            Query << " WHERE id::text IN (" << Ids << ") OR typecode IN (" << Names << ")";
+            Query << " ORDER BY 3 DESC;";
 
-                try {
-                    auto pQuery = ExecSQL(SQL, nullptr, OnExecuted, OnException);
-                    pQuery->Data().AddPair("session", session);
-                } catch (Delphi::Exception::Exception &E) {
-                    DoFatal(E);
-                }
+            CStringList SQL;
+
+            for (int i = 0; i < Sessions.Count(); ++i) {
+                Authorize(SQL, Sessions[i]);
+                SQL.Add(Query);
+            }
+
+            try {
+                ExecPool(m_Control, SQL, OnExecuted, OnException);
+                m_PendingCheck = true;
+            } catch (Delphi::Exception::Exception &E) {
+                DoConnectError(E);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::DoFatal(const Delphi::Exception::Exception &E) {
-            m_AuthDate = Now() + (CDateTime) SLEEP_SECOND_AFTER_ERROR / SecsPerDay; // 10 sec;
-            m_CheckDate = m_AuthDate;
+        void CTaskScheduler::JobFinished(const CJobContext &Job, const CString &Action) {
+            m_Journal.End(Job.Id);
 
-            m_Status = psStopped;
+            Activity();
 
-            Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
-            Log()->Notice("Continue after %d seconds", SLEEP_SECOND_AFTER_ERROR);
+            if (Job.Missed && !Job.Skip && Action == "done") {
+                const auto it = m_Misfired.find(Job.Id.c_str());
+                if (it != m_Misfired.end())
+                    it->second.Done = true;
+            }
+
+            if (m_Depends.empty() || (Action != "done" && Action != "complete"))
+                return;
+
+            // A local upstream completion is checked against the database right away instead of at the next poll.
+            if (m_Upstream.count(Job.Id.c_str()) != 0 || m_Upstream.count(Job.TypeCode.c_str()) != 0)
+                CheckDepends();
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::DoError(const Delphi::Exception::Exception &E) {
-            Log()->Error(APP_LOG_ERR, 0, "%s", E.what());
+        void CTaskScheduler::Unblock() {
+            for (auto it = m_Blocked.begin(); it != m_Blocked.end();) {
+                if (Satisfied(it->second)) {
+                    // Back in the queue with its own due time, which has passed: it starts on the next dispatch.
+                    m_Ready.Push(it->second.Job, it->second.Due);
+                    it = m_Blocked.erase(it);
+                } else {
+                    ++it;
+                }
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::Heartbeat(CDateTime Now) {
-            if ((Now >= m_AuthDate)) {
-                m_AuthDate = Now + (CDateTime) 5 / SecsPerDay; // 5 sec
-                Authentication();
+        CJobExecutor *CTaskScheduler::Executor(const CString &TypeCode) const {
+            for (auto pExecutor : m_Executors) {
+                if (pExecutor->Handles(TypeCode))
+                    return pExecutor;
             }
+            return nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            if (m_Status == psRunning) {
-                if ((Now >= m_CheckDate)) {
-                    m_CheckDate = Now + (CDateTime) m_HeartbeatInterval / MSecsPerDay;
-                    CheckJob();
-                }
+        void CTaskScheduler::CheckExecutors() {
+            for (auto pExecutor : m_Executors) {
+                if (pExecutor->Count() != 0)
+                    pExecutor->Poll();
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::DoTimer(CPollEventHandler *AHandler) {
-            uint64_t exp;
+        void CTaskScheduler::ExecutorDone(const CJobRef &Job, int Status, const CString &Output) {
+            auto pTask = m_Jobs.Find(Job->Id);
 
-            auto pTimer = dynamic_cast<CEPollTimer *> (AHandler->Binding());
-            pTimer->Read(&exp, sizeof(uint64_t));
+            // Timed out or canceled: the transition is already on its way.
+            if (pTask == nullptr || pTask->State() != tsRun) {
+                Finishing(Job->Id);
+                return;
+            }
 
-            try {
-                Heartbeat(AHandler->TimeStamp());
-            } catch (Delphi::Exception::Exception &E) {
-                DoServerEventHandlerException(AHandler, E);
+            if (Status == 0) {
+                if (!Output.IsEmpty())
+                    Log()->Debug(APP_LOG_DEBUG_CORE, "[%s] %s", Job->Id.c_str(), Output.c_str());
+                JobExecuted(Job);
+                return;
             }
+
+            pTask->State(tsFinish);
+
+            const auto label = CString().Format("Executor exited with code %d: %s", Status, Output.c_str());
+
+            m_Metrics.Errors++;
+            Log()->Error(APP_LOG_ERR, 0, "[%s] %s", Job->Id.c_str(), label.c_str());
+
+            DoFail(Job, label);
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::DeleteJob(const CString &Id) {
-            const auto index = m_Jobs.IndexOf(Id);
-            if (index != -1)
-                m_Jobs.Delete(index);
+        bool CTaskScheduler::JobRecovered(const CString &Session, const CString &Id, const CString &TypeCode) {
+            const auto pEntry = m_Journal.Find(Id);
+            if (pEntry == nullptr)
+                return false;
+
+            // "executed" in the database after a pipelined start means the body committed with it.
+            // A two-step start or an executor is trusted only with a record of its body finishing.
+            if (!pEntry->Executed && pEntry->Mode != CJournal::jmPipeline)
+                return false;
+
+            Log()->Notice("[%s] Task finished before the restart, completing it from the journal.", Id.c_str());
+
+            auto job = NewJob(Session, Id);
+            job->TypeCode = TypeCode;
+
+            if (TypeCode == "periodic.job") {
+                DoDone(job);
+            } else {
+                DoComplete(job);
+            }
+
+            return true;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::DoRun(const CString &Session, const CString &Id, const CString &TypeCode, const CString &Body) {
+        void CTaskScheduler::JobExecuted(const CJobRef &Job) {
+            m_Journal.Executed(Job->Id);
 
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+            auto pTask = m_Jobs.Find(Job->Id);
+            if (pTask != nullptr) {
+                pTask->Query(nullptr);
+                pTask->State(tsFinish);
+
+                m_Metrics.Execution[Job->TypeCode.c_str()].Observe((Now() - pTask->RunDate()) * SecsPerDay);
+
+                if (m_BenchInterval > 0)
+                    m_Bench.Observe(pTask->Pipelined() ? "launch" : "run", (Now() - pTask->RunDate()) * SecsPerDay);
+            }
+
+            m_Metrics.Finished++;
+
+            m_Retry.erase(Job->Id.c_str());
+
+            if (Job->TypeCode == "periodic.job") {
+                DoDone(Job);
+            } else {
+                DoComplete(Job);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::DoStart(const CJobRef &Job) {
 
-                const auto &session = APollQuery->Data()["session"];
-                const auto &id = APollQuery->Data()["id"];
-                const auto &type_code = APollQuery->Data()["type_code"];
+            const auto sent = Now();
+
+            auto OnExecuted = [this, Job, sent](CPQPollQuery *APollQuery) {
+
+                const auto &id = Job->Id;
+
+                if (m_BenchInterval > 0)
+                    m_Bench.Observe("start", (Now() - sent) * SecsPerDay);
 
                 CPQResult *pResult;
                 try {
@@ -365,58 +3322,58 @@ namespace Apostol {
                             throw Delphi::Exception::EDBError(pResult->GetErrorMessage());
                     }
 
-                    if (type_code == "periodic.job") {
-                        DoDone(session, id);
-                    } else {
-                        DoComplete(session, id);
-                    }
+                    DoRun(Job);
                 } catch (Delphi::Exception::Exception &E) {
                     DeleteJob(id);
-                    DoError(E);
+                    DoRetry(id, E);
                 }
             };
 
-            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                const auto &id = APollQuery->Data()["id"];
+            auto OnException = [this, Job](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                const auto &id = Job->Id;
                 DeleteJob(id);
-                DoFatal(E);
+                DoRetry(id, E);
             };
 
             CStringList SQL;
 
-            api::authorize(SQL, Session);
-            SQL.Add(Body);
+            Authorize(SQL, Job->Session);
+            ExecuteAction(SQL, Job->Id, "execute");
 
-            Log()->Message("[%s] Task started.", Id.c_str());
+            // The label names the node that runs the job, so that peers can tell a live job from an orphan.
+            if (m_Cluster)
+                SetLabel(SQL, Job->Id, m_Node);
 
             try {
-                auto pQuery = ExecSQL(SQL, nullptr, OnExecuted, OnException);
+                ExecPool(m_Control, SQL, OnExecuted, OnException);
 
-                pQuery->Data().AddPair("session", Session);
-                pQuery->Data().AddPair("id", Id);
-                pQuery->Data().AddPair("type_code", TypeCode);
+                auto pTask = m_Jobs.Add(Job);
 
-                const auto index = m_Jobs.IndexOf(Id);
-                if (index != -1)
-                    m_Jobs.Objects(index, (CPQQuery *) pQuery);
+                pTask->StartDate(Now());
+                pTask->State(tsStart);
             } catch (Delphi::Exception::Exception &E) {
-                DeleteJob(Id);
-                DoFatal(E);
+                DeleteJob(Job->Id);
+                DoConnectError(E);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::DoStart(const CString &Session, const CString &Id, const CString &TypeCode, const CString &Body) {
+        void CTaskScheduler::DoLaunch(const CJobRef &Job) {
 
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+            // Index of the first result of the body, as the batch below is built: a reload must not change it.
+            const auto body = m_Cluster ? QUERY_INDEX_BODY + 1 : QUERY_INDEX_BODY;
+
+            auto OnExecuted = [this, Job, body](CPQPollQuery *APollQuery) {
+
+                const auto &id = Job->Id;
 
-                const auto &session = APollQuery->Data()["session"];
-                const auto &id = APollQuery->Data()["id"];
-                const auto &type_code = APollQuery->Data()["type_code"];
-                const auto &body = APollQuery->Data()["body"];
+                if (Finishing(id))
+                    return;
 
                 CPQResult *pResult;
                 try {
+                    // The "execute" transition and the body share one implicit transaction:
+                    // the first failed statement rolls back both and ends the result list.
                     for (int i = 0; i < APollQuery->Count(); i++) {
                         pResult = APollQuery->Results(i);
 
@@ -424,184 +3381,399 @@ namespace Apostol {
                             throw Delphi::Exception::EDBError(pResult->GetErrorMessage());
                     }
 
-                    DoRun(session, id, type_code, body);
+                    if (APollQuery->Count() <= body)
+                        throw Delphi::Exception::ExceptionFrm("[%s] Task body returned no result.", id.c_str());
+
+                    JobExecuted(Job);
                 } catch (Delphi::Exception::Exception &E) {
-                    DoError(E);
+                    LaunchFailed(Job, E);
                 }
             };
 
-            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                const auto &id = APollQuery->Data()["id"];
-                DeleteJob(id);
-                DoFatal(E);
+            auto OnException = [this, Job](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                if (Finishing(Job->Id))
+                    return;
+
+                LaunchFailed(Job, E);
             };
 
             CStringList SQL;
 
-            api::authorize(SQL, Session);
-            api::execute_object_action(SQL, Id, "execute");
+            Authorize(SQL, Job->Session);
+            ExecuteAction(SQL, Job->Id, "execute");
+
+            if (body > QUERY_INDEX_BODY)
+                SetLabel(SQL, Job->Id, m_Node);
+
+            SQL.Add(Job->Body);
 
             try {
-                auto pQuery = ExecSQL(SQL, nullptr, OnExecuted, OnException);
+                auto pQuery = ExecPool(m_Execution, SQL, OnExecuted, OnException);
 
-                pQuery->Data().AddPair("session", Session);
-                pQuery->Data().AddPair("id", Id);
-                pQuery->Data().AddPair("type_code", TypeCode);
-                pQuery->Data().AddPair("body", Body);
+                auto pTask = m_Jobs.Add(Job);
 
-                m_Jobs.Add(Id);
+                pTask->StartDate(Now());
+                pTask->Pipelined(true);
+
+                JobStarted(Job->Id, pQuery);
+                m_Journal.Start(Job->Id, CJournal::jmPipeline);
+
+                Log()->Message("[%s] Task started.", Job->Id.c_str());
             } catch (Delphi::Exception::Exception &E) {
-                DoFatal(E);
+                DeleteJob(Job->Id);
+                DoConnectError(E);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::DoFail(const CString &Session, const CString &Id, const CString &Error) {
+        CString CTaskScheduler::TransitionMessage(const CString &Action) {
+            if (Action == "done")
+                return "Task done.";
+            if (Action == "complete")
+                return "Task completed.";
+            if (Action == "abort")
+                return "Task aborted.";
+            if (Action == "cancel")
+                return "Task canceled.";
+            if (Action == "fail")
+                return "Task failed.";
+            return CString().Format("Task %s.", Action.c_str());
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
-                const auto &id = APollQuery->Data()["id"];
-                DeleteJob(id);
-                Log()->Message("[%s] Task failed.", id.c_str());
+        void CTaskScheduler::DoTransition(const CJobRef &Job, const CString &Action, const CString &Label, bool Execute) {
+            if (m_Tracer.Active()) {
+                auto pTask = m_Jobs.Find(Job->Id);
+                if (pTask != nullptr && pTask->FinishDate() == 0)
+                    pTask->FinishDate(Now());
+            }
+
+            if (m_Batch) {
+                m_Transitions.emplace_back(Job, Action, Label, Execute);
+            } else {
+                SendTransition(CTransition(Job, Action, Label, Execute));
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTaskScheduler::SendTransition(const CTransition &Transition) {
+
+            const auto sent = Now();
+
+            const auto &Job = Transition.Job;
+            const auto &Action = Transition.Action;
+
+            auto OnExecuted = [this, sent, Job, Action](CPQPollQuery *APollQuery) {
+                m_Metrics.Transition.Observe((Now() - sent) * SecsPerDay);
+
+                if (m_BenchInterval > 0)
+                    m_Bench.Observe("transition", (Now() - sent) * SecsPerDay);
+
+                CPQResult *pResult;
+                try {
+                    for (int i = 0; i < APollQuery->Count(); i++) {
+                        pResult = APollQuery->Results(i);
+
+                        if (pResult->ExecStatus() != PGRES_TUPLES_OK)
+                            throw Delphi::Exception::ExceptionFrm("[%s] Transition \"%s\" failed: %s", Job->Id.c_str(),
+                                                                  Action.c_str(), pResult->GetErrorMessage());
+                    }
+                } catch (Delphi::Exception::Exception &E) {
+                    DeleteJob(Job->Id);
+                    DoError(E);
+                    return;
+                }
+
+                Trace(Job->Id, Action);
+                DeleteJob(Job->Id);
+                Log()->Message("[%s] %s", Job->Id.c_str(), TransitionMessage(Action).c_str());
+
+                // Only a confirmed transition releases the jobs that depend on this one.
+                JobFinished(*Job, Action);
             };
 
-            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                const auto &id = APollQuery->Data()["id"];
-                DeleteJob(id);
+            auto OnException = [this, Job](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DeleteJob(Job->Id);
                 DoError(E);
             };
 
             CStringList SQL;
 
-            api::authorize(SQL, Session);
-            api::execute_object_action(SQL, Id, "fail");
-            api::set_object_label(SQL, Id, Error);
+            Authorize(SQL, Job->Session);
+
+            if (Transition.Execute)
+                ExecuteAction(SQL, Job->Id, "execute");
+
+            ExecuteAction(SQL, Job->Id, Action);
+
+            if (Action == "fail")
+                SetLabel(SQL, Job->Id, Transition.Label);
 
             try {
-                auto pQuery = ExecSQL(SQL, nullptr, OnExecuted, OnException);
-                pQuery->Data().AddPair("id", Id);
+                ExecPool(m_Control, SQL, OnExecuted, OnException);
             } catch (Delphi::Exception::Exception &E) {
-                DoFatal(E);
+                // The job leaves the scheduler: its row is picked up again by orphan and journal recovery.
+                DeleteJob(Job->Id);
+                DoConnectError(E);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::DoDone(const CString &Session, const CString &Id) {
+        void CTaskScheduler::SendTransitions(const CTransitions &List) {
 
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
-                const auto &id = APollQuery->Data()["id"];
-                DeleteJob(id);
-                Log()->Message("[%s] Task done.", id.c_str());
+            const auto sent = Now();
+
+            auto OnExecuted = [this, sent](CPQPollQuery *APollQuery) {
+                m_Metrics.Transition.Observe((Now() - sent) * SecsPerDay);
+
+                if (m_BenchInterval > 0)
+                    m_Bench.Observe("transition", (Now() - sent) * SecsPerDay);
+
+                const auto it = m_Batches.find(APollQuery);
+                if (it == m_Batches.end())
+                    return;
+
+                const CTransitions Batch(std::move(it->second));
+                m_Batches.erase(it);
+
+                CPQResult *pResult;
+                try {
+                    for (int i = 0; i < APollQuery->Count(); i++) {
+                        pResult = APollQuery->Results(i);
+
+                        if (pResult->ExecStatus() != PGRES_TUPLES_OK)
+                            throw Delphi::Exception::EDBError(pResult->GetErrorMessage());
+                    }
+
+                    for (const auto &transition : Batch) {
+                        Trace(transition.Job->Id, transition.Action);
+                        DeleteJob(transition.Job->Id);
+                        Log()->Message("[%s] %s", transition.Job->Id.c_str(), TransitionMessage(transition.Action).c_str());
+                        JobFinished(*transition.Job, transition.Action);
+                    }
+                } catch (Delphi::Exception::Exception &E) {
+                    // The batch is one implicit transaction, so nothing was applied.
+                    // Replay it job by job to find out which transition is at fault.
+                    if (Batch.size() == 1) {
+                        const auto &transition = Batch.front();
+                        DeleteJob(transition.Job->Id);
+                        DoError(Delphi::Exception::ExceptionFrm("[%s] Transition \"%s\" failed: %s", transition.Job->Id.c_str(),
+                                                                transition.Action.c_str(), E.what()));
+                    } else {
+                        for (const auto &transition : Batch) {
+                            SendTransition(transition);
+                        }
+                    }
+                }
             };
 
             auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                const auto &id = APollQuery->Data()["id"];
-                DeleteJob(id);
+                const auto it = m_Batches.find(APollQuery);
+                if (it == m_Batches.end()) {
+                    DoError(E);
+                    return;
+                }
+
+                for (const auto &transition : it->second) {
+                    DeleteJob(transition.Job->Id);
+                }
+
+                m_Batches.erase(it);
+
                 DoError(E);
             };
 
             CStringList SQL;
 
-            api::authorize(SQL, Session);
-            api::execute_object_action(SQL, Id, "done");
+            // All transitions of a batch belong to one session.
+            Authorize(SQL, List.front().Job->Session);
+
+            for (const auto &transition : List) {
+                const auto &id = transition.Job->Id;
+
+                if (transition.Execute)
+                    ExecuteAction(SQL, id, "execute");
+
+                ExecuteAction(SQL, id, transition.Action);
+
+                if (transition.Action == "fail")
+                    SetLabel(SQL, id, transition.Label);
+            }
 
             try {
-                auto pQuery = ExecSQL(SQL, nullptr, OnExecuted, OnException);
-                pQuery->Data().AddPair("id", Id);
+                auto pQuery = ExecPool(m_Control, SQL, OnExecuted, OnException);
+                m_Batches[pQuery] = List;
             } catch (Delphi::Exception::Exception &E) {
-                DoFatal(E);
+                for (const auto &transition : List) {
+                    DeleteJob(transition.Job->Id);
+                }
+                DoConnectError(E);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::DoComplete(const CString &Session, const CString &Id) {
+        void CTaskScheduler::FlushTransitions() {
+            if (m_Transitions.empty())
+                return;
 
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
-                const auto &id = APollQuery->Data()["id"];
-                DeleteJob(id);
-                Log()->Message("[%s] Task completed.", id.c_str());
-            };
+            CTransitions Pending;
+            Pending.swap(m_Transitions);
 
-            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                const auto &id = APollQuery->Data()["id"];
-                DeleteJob(id);
-                DoError(E);
-            };
+            std::vector<std::string> Sessions;
+            std::unordered_map<std::string, CTransitions> Groups;
 
-            CStringList SQL;
+            for (auto &transition : Pending) {
+                const std::string session(transition.Job->Session.c_str());
 
-            api::authorize(SQL, Session);
-            api::execute_object_action(SQL, Id, "complete");
+                auto it = Groups.find(session);
+                if (it == Groups.end()) {
+                    Sessions.push_back(session);
+                    it = Groups.emplace(session, CTransitions()).first;
+                }
 
-            try {
-                auto pQuery = ExecSQL(SQL, nullptr, OnExecuted, OnException);
-                pQuery->Data().AddPair("id", Id);
-            } catch (Delphi::Exception::Exception &E) {
-                DoFatal(E);
+                it->second.push_back(std::move(transition));
+            }
+
+            for (const auto &session : Sessions) {
+                const auto &List = Groups[session];
+
+                if (List.size() == 1) {
+                    SendTransition(List.front());
+                } else {
+                    SendTransitions(List);
+                }
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::DoAbort(const CString &Session, const CString &Id) {
-
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
-                const auto &id = APollQuery->Data()["id"];
-                DeleteJob(id);
-                Log()->Message("[%s] Task aborted.", id.c_str());
-            };
+        void CTaskScheduler::DoFail(const CJobRef &Job, const CString &Error) {
+            DoTransition(Job, "fail", Error);
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                const auto &id = APollQuery->Data()["id"];
-                DeleteJob(id);
-                DoError(E);
-            };
+        void CTaskScheduler::DoDone(const CJobRef &Job) {
+            DoTransition(Job, "done");
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            CStringList SQL;
+        void CTaskScheduler::DoComplete(const CJobRef &Job) {
+            DoTransition(Job, "complete");
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            api::authorize(SQL, Session);
-            api::execute_object_action(SQL, Id, "abort");
+        void CTaskScheduler::DoAbort(const CJobRef &Job) {
+            DoTransition(Job, "abort");
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            try {
-                auto pQuery = ExecSQL(SQL, nullptr, OnExecuted, OnException);
-                pQuery->Data().AddPair("id", Id);
-            } catch (Delphi::Exception::Exception &E) {
-                DoFatal(E);
-            }
+        void CTaskScheduler::DoCancel(const CJobRef &Job) {
+            DoTransition(Job, "cancel");
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CTaskScheduler::DoCancel(const CString &Session, const CString &Id) {
+        void CTaskScheduler::Metrics(CString &Output) const {
+            const CString prefix("task_scheduler");
 
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
-                const auto &id = APollQuery->Data()["id"];
-                DeleteJob(id);
-                Log()->Message("[%s] Task canceled.", id.c_str());
+            auto Gauge = [&Output, &prefix](LPCTSTR Name, LPCTSTR Help, double Value) {
+                Output << CString().Format("# HELP %s_%s %s\n", prefix.c_str(), Name, Help);
+                Output << CString().Format("# TYPE %s_%s gauge\n", prefix.c_str(), Name);
+                Output << CString().Format("%s_%s %g\n", prefix.c_str(), Name, Value);
             };
 
-            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                const auto &id = APollQuery->Data()["id"];
-                DeleteJob(id);
-                DoError(E);
+            auto Counter = [&Output, &prefix](LPCTSTR Name, LPCTSTR Help, unsigned long Value) {
+                Output << CString().Format("# HELP %s_%s %s\n", prefix.c_str(), Name, Help);
+                Output << CString().Format("# TYPE %s_%s counter\n", prefix.c_str(), Name);
+                Output << CString().Format("%s_%s %lu\n", prefix.c_str(), Name, Value);
             };
 
-            CStringList SQL;
+            auto Histogram = [&Output, &prefix](LPCTSTR Name, LPCTSTR Help) {
+                Output << CString().Format("# HELP %s_%s %s\n", prefix.c_str(), Name, Help);
+                Output << CString().Format("# TYPE %s_%s histogram\n", prefix.c_str(), Name);
+                return prefix + "_" + Name;
+            };
 
-            api::authorize(SQL, Session);
-            api::execute_object_action(SQL, Id, "cancel");
+            Gauge("jobs_in_flight", "Jobs started and not yet finished.", m_Active);
+            Gauge("jobs_limit", "Maximum number of jobs running at once.", m_MaxJobs);
+            Gauge("ready_queue_depth", "Jobs waiting in the ready queue.", (double) m_Ready.Count());
+            Gauge("blocked_jobs", "Due jobs waiting for their upstream jobs.", (double) m_Blocked.size());
+            Gauge("sessions", "Authorized bot sessions.", m_Sessions.Count());
+
+            if (m_Cluster)
+                Gauge("cluster_nodes", "Live scheduler nodes, this one included.", (double) m_Nodes.size() + 1);
+
+            Counter("jobs_started_total", "Job bodies sent for execution.", m_Metrics.Started);
+            Counter("jobs_finished_total", "Job bodies executed successfully.", m_Metrics.Finished);
+            Counter("timeouts_total", "Jobs canceled after exceeding their execution timeout.", m_Metrics.Timeouts);
+            Counter("fatal_total", "Errors that paused the scheduler (DoFatal).", m_Metrics.Fatal);
+            Counter("errors_total", "Errors reported through DoError.", m_Metrics.Errors);
+
+            for (const auto pPool : {&m_Control, &m_Execution}) {
+                const auto labels = CString().Format("pool=\"%s\"", pPool->Name.c_str());
+                Output << CString().Format("%s_pool_busy{%s} %d\n", prefix.c_str(), labels.c_str(), pPool->Busy);
+                Output << CString().Format("%s_pool_size{%s} %d\n", prefix.c_str(), labels.c_str(), pPool->Size);
+                Output << CString().Format("%s_pool_peak{%s} %d\n", prefix.c_str(), labels.c_str(), pPool->Peak);
+                if (pPool->Name == m_Execution.Name)
+                    break;
+            }
 
-            try {
-                auto pQuery = ExecSQL(SQL, nullptr, OnExecuted, OnException);
-                pQuery->Data().AddPair("id", Id);
-            } catch (Delphi::Exception::Exception &E) {
-                DoFatal(E);
+            m_Metrics.StartLatency.Render(Output, Histogram("start_latency_seconds", "Time from the due time to the job body being sent.").c_str());
+            m_Metrics.Transition.Render(Output, Histogram("transition_seconds", "Round trip of state transition queries.").c_str());
+            m_Metrics.CheckJob.Render(Output, Histogram("check_job_seconds", "Duration of a job list poll.").c_str());
+
+            const auto execution = Histogram("execution_seconds", "Job body execution time by type.");
+            for (const auto &it : m_Metrics.Execution) {
+                it.second.Render(Output, execution.c_str(), CString().Format("type_code=\"%s\"", it.first.c_str()));
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
         bool CTaskScheduler::DoExecute(CTCPConnection *AConnection) {
+            auto pConnection = dynamic_cast<CHTTPServerConnection *> (AConnection);
+            if (pConnection == nullptr)
+                return false;
+
+            const auto &caRequest = pConnection->Request();
+            auto &Reply = pConnection->Reply();
+
+            if (caRequest.Method == "GET" && caRequest.Location.pathname == "/bench" && m_BenchInterval > 0) {
+                m_Bench.Report(Reply.Content, Now(), m_Metrics.Started, m_Metrics.Finished);
+                pConnection->SendReply(CHTTPReply::ok, "text/plain; charset=utf-8", true);
+                return true;
+            }
+
+            if (caRequest.Method != "GET" || caRequest.Location.pathname != "/metrics") {
+                pConnection->SendStockReply(CHTTPReply::not_found);
+                return true;
+            }
+
+            Metrics(Reply.Content);
+
+            pConnection->SendReply(CHTTPReply::ok, "text/plain; version=0.0.4; charset=utf-8", true);
+
             return true;
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CTaskScheduler::DoPostgresNotify(CPQConnection *AConnection, PGnotify *ANotify) {
+            DebugNotify(AConnection, ANotify);
+
+            if (m_Cluster && m_ClusterChannel == ANotify->relname) {
+                NodeSeen(ANotify->extra);
+                return;
+            }
+
+            if (!m_Notify || m_Channel != ANotify->relname)
+                return;
+
+            // An empty payload means "something changed", so re-read the whole list.
+            if (ANotify->extra == nullptr || *ANotify->extra == '\0') {
+                m_NotifiedAll = true;
+            } else if (!m_NotifiedAll) {
+                m_Notified.emplace(ANotify->extra);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CTaskScheduler::DoPostgresQueryExecuted(CPQPollQuery *APollQuery) {
             CPQResult *pResult;
             try {
@@ -622,10 +3794,22 @@ namespace Apostol {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CTaskScheduler::DoPQConnect(CObject *Sender) {
+            CServerProcess::DoPQConnect(Sender);
+
+            // Prepared statements live as long as the session: a reconnected connection gets them again,
+            // in one batch that is the first query on it.
+            auto pConnection = dynamic_cast<CPQConnection *> (Sender);
+            if (m_Prepare && pConnection != nullptr) {
+                Prepare(pConnection);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CTaskScheduler::DoPQConnectException(CPQConnection *AConnection, const Delphi::Exception::Exception &E) {
             CServerProcess::DoPQConnectException(AConnection, E);
             if (m_Status == psRunning) {
-                DoFatal(E);
+                DoConnectError(E);
             }
         }
     }
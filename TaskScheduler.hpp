@@ -25,6 +25,23 @@ Author:
 #define APOSTOL_PROCESS_TASK_SCHEDULER_HPP
 //----------------------------------------------------------------------------------------------------------------------
 
+#include <map>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <set>
+#include <queue>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+//----------------------------------------------------------------------------------------------------------------------
+
 extern "C++" {
 
 namespace Apostol {
@@ -33,6 +50,623 @@ namespace Apostol {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CJobContext -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CJobContext {
+
+            CString Session;
+            CString Id;
+            CString TypeCode;
+            CString Body;
+            CString DateRun;
+
+            // A run of a periodic job that was missed while the scheduler was down.
+            bool Missed = false;
+            // A missed run that is moved on to its next slot without executing the body.
+            bool Skip = false;
+
+            void Clear() {
+                Session.Clear();
+                Id.Clear();
+                TypeCode.Clear();
+                Body.Clear();
+                DateRun.Clear();
+                Missed = false;
+                Skip = false;
+            }
+
+        };
+
+        typedef std::shared_ptr<CJobContext> CJobRef;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJobPool --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CJobPool {
+            typedef std::vector<std::unique_ptr<CJobContext>> CFree;
+
+        private:
+
+            // Shared with the references handed out: a context may be released after the pool is gone.
+            std::shared_ptr<CFree> m_Free;
+
+            size_t m_Limit;
+
+        public:
+
+            explicit CJobPool(size_t Limit = 64): m_Free(std::make_shared<CFree>()), m_Limit(Limit) {
+
+            }
+
+            CJobRef Get();
+
+            size_t Count() const { return m_Free->size(); }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTask -----------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        enum CTaskState { tsQueue = 0, tsStart, tsRun, tsTimeout, tsFinish };
+
+        // What to do with a run that was missed while the scheduler was down: run every one, run one, skip them.
+        enum CMisfirePolicy { mpAll = 0, mpOnce, mpSkip };
+
+        // A run of consecutive missed runs of one job: when its catch-up began and whether a run has been done.
+        struct CMisfireSeries {
+            CDateTime Start = 0;
+            bool Done = false;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CTask: public CCollectionItem {
+        private:
+
+            CJobRef m_Job;
+
+            CTaskState m_State;
+
+            CDateTime m_Due;
+            CDateTime m_EnumDate;
+            CDateTime m_StartDate;
+            CDateTime m_RunDate;
+            CDateTime m_FinishDate;
+            CDateTime m_Deadline;
+
+            bool m_Pipelined;
+
+            CPQQuery *m_pQuery;
+
+        public:
+
+            CTask(CCollection *ACollection, const CJobRef &Job);
+
+            ~CTask() override = default;
+
+            const CJobRef &Job() const { return m_Job; }
+
+            const CString &Id() const { return m_Job->Id; }
+            const CString &Session() const { return m_Job->Session; }
+            const CString &TypeCode() const { return m_Job->TypeCode; }
+
+            CTaskState State() const { return m_State; }
+            void State(CTaskState Value) { m_State = Value; }
+
+            CDateTime Due() const { return m_Due; }
+            void Due(CDateTime Value) { m_Due = Value; }
+
+            CDateTime EnumDate() const { return m_EnumDate; }
+            void EnumDate(CDateTime Value) { m_EnumDate = Value; }
+
+            CDateTime StartDate() const { return m_StartDate; }
+            void StartDate(CDateTime Value) { m_StartDate = Value; }
+
+            CDateTime RunDate() const { return m_RunDate; }
+            void RunDate(CDateTime Value) { m_RunDate = Value; }
+
+            CDateTime FinishDate() const { return m_FinishDate; }
+            void FinishDate(CDateTime Value) { m_FinishDate = Value; }
+
+            CDateTime Deadline() const { return m_Deadline; }
+            void Deadline(CDateTime Value) { m_Deadline = Value; }
+
+            // Started together with its "execute" transition: nothing of the start is committed until the body is.
+            bool Pipelined() const { return m_Pipelined; }
+            void Pipelined(bool Value) { m_Pipelined = Value; }
+
+            CPQQuery *Query() const { return m_pQuery; }
+            void Query(CPQQuery *Value) { m_pQuery = Value; }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CHistogram -------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CHistogram {
+        private:
+
+            std::vector<unsigned long> m_Buckets;
+
+            unsigned long m_Count;
+            double m_Sum;
+
+        public:
+
+            CHistogram();
+
+            void Observe(double Value);
+
+            void Render(CString &Output, LPCTSTR Name, const CString &Labels = CString()) const;
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CSchedulerMetrics -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CSchedulerMetrics {
+
+            CHistogram StartLatency;
+            CHistogram Transition;
+            CHistogram CheckJob;
+
+            std::unordered_map<std::string, CHistogram> Execution;
+
+            unsigned long Started = 0;
+            unsigned long Finished = 0;
+
+            unsigned long Timeouts = 0;
+            unsigned long Fatal = 0;
+            unsigned long Errors = 0;
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CBenchmark ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CBenchmark {
+        private:
+
+            struct CPhase {
+                std::vector<double> Samples;
+                unsigned long Count = 0;
+                double Total = 0;
+                double Max = 0;
+            };
+
+            std::map<std::string, CPhase> m_Phases;
+
+            size_t m_Limit;
+
+            CDateTime m_Start;
+
+            unsigned long m_Started;
+            unsigned long m_Finished;
+
+            static double Quantile(std::vector<double> &Samples, double Value);
+
+        public:
+
+            explicit CBenchmark(size_t Limit = 100000): m_Limit(Limit), m_Start(0), m_Started(0), m_Finished(0) {
+
+            }
+
+            void Observe(LPCTSTR Phase, double Seconds);
+
+            void Reset(CDateTime Now, unsigned long Started, unsigned long Finished);
+
+            void Report(CString &Output, CDateTime Now, unsigned long Started, unsigned long Finished) const;
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTaskManager ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CTaskManager: public CCollection {
+            typedef CCollection inherited;
+
+        private:
+
+            std::unordered_map<std::string, CTask *> m_Index;
+
+            CTask *Get(int Index) const;
+            void Set(int Index, CTask *Value);
+
+        public:
+
+            CTaskManager(): CCollection(this) {
+
+            }
+
+            ~CTaskManager() override {
+                Clear();
+            }
+
+            CTask *Add(const CJobRef &Job);
+
+            CTask *Find(const CString &Id) const;
+
+            bool Delete(const CString &Id);
+
+            void Clear();
+
+            CTask *Tasks(int Index) const { return Get(Index); }
+            void Tasks(int Index, CTask *Value) { Set(Index, Value); }
+
+            CTask *operator[] (const CString &Id) const { return Find(Id); }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CReadyJob -------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CReadyJob {
+
+            CJobRef Job;
+
+            CDateTime Due;
+            unsigned long Sequence;
+
+            bool operator< (const CReadyJob &Value) const {
+                if (Due != Value.Due)
+                    return Due < Value.Due;
+                return Sequence < Value.Sequence;
+            }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CReadyQueue -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CReadyQueue {
+        public:
+
+            typedef std::set<CReadyJob> CItems;
+            typedef CItems::const_iterator CIterator;
+
+        private:
+
+            CItems m_Items;
+            std::unordered_map<std::string, CIterator> m_Index;
+
+            unsigned long m_Sequence;
+
+        public:
+
+            CReadyQueue(): m_Sequence(0) {
+
+            }
+
+            bool Push(const CJobRef &Job, CDateTime Due);
+
+            bool Remove(const CString &Id);
+            CIterator Erase(CIterator Position);
+
+            bool Contains(const CString &Id) const { return m_Index.count(Id.c_str()) != 0; }
+
+            void Clear();
+
+            size_t Count() const { return m_Items.size(); }
+            bool Empty() const { return m_Items.empty(); }
+
+            CIterator begin() const { return m_Items.begin(); }
+            CIterator end() const { return m_Items.end(); }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CSyncCursor -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CSyncCursor {
+
+            CString Cursor;
+            CString Horizon;
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CPQPool ----------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CPQPool {
+
+            CString Name;
+            CPQClient *Client = nullptr;
+
+            int Size = 0;
+            int Busy = 0;
+            int Peak = 0;
+
+            bool Saturated = false;
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CBackoff ---------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CBackoff {
+
+            int Attempts = 0;
+            CDateTime Until = 0;
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTracer ---------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CTracer {
+        private:
+
+            CString m_FileName;
+
+            int m_Handle;
+
+            std::string m_Buffer;
+
+            static void Span(std::string &Line, const char *Name, CDateTime From, CDateTime To);
+
+        public:
+
+            CTracer(): m_Handle(-1) {
+
+            }
+
+            ~CTracer() {
+                Close();
+            }
+
+            void FileName(const CString &Value);
+            void Close();
+
+            bool Active() const { return !m_FileName.IsEmpty(); }
+
+            void Write(const CTask *ATask, const CString &Action, CDateTime Now);
+
+            void Flush();
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTokenBucket ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CTokenBucket {
+        private:
+
+            double m_Rate;
+            double m_Burst;
+
+            double m_Tokens;
+            CDateTime m_Stamp;
+
+            void Refill(CDateTime Now);
+
+        public:
+
+            CTokenBucket(): CTokenBucket(0, 0) {
+
+            }
+
+            CTokenBucket(double Rate, double Burst): m_Rate(Rate), m_Burst(Burst < 1 ? 1 : Burst), m_Tokens(m_Burst), m_Stamp(0) {
+
+            }
+
+            bool Ready(CDateTime Now);
+            void Take(CDateTime Now);
+
+            CDateTime Next(CDateTime Now);
+
+            void Limits(const CTokenBucket &Value);
+
+            static bool Parse(const CString &Value, CTokenBucket &Bucket);
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTransition -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CTransition {
+
+            CJobRef Job;
+
+            CString Action;
+            CString Label;
+
+            bool Execute;
+
+            CTransition(const CJobRef &Job, const CString &Action, const CString &Label, bool Execute = false):
+                Job(Job), Action(Action), Label(Label), Execute(Execute) {
+
+            }
+
+        };
+
+        typedef std::vector<CTransition> CTransitions;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJobExecutor ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CJobExecutor {
+        public:
+
+            // Status is zero on success; Output is whatever the executor has to say about the job.
+            typedef std::function<void (const CJobRef &Job, int Status, const CString &Output)> COnDone;
+
+        protected:
+
+            COnDone m_OnDone;
+
+        public:
+
+            virtual ~CJobExecutor() = default;
+
+            virtual bool Handles(const CString &TypeCode) const = 0;
+
+            // Starts the job without blocking; throws if it cannot be started.
+            virtual void Start(const CJobRef &Job) = 0;
+            virtual bool Cancel(const CString &Id) = 0;
+
+            // Non-blocking: moves the running jobs along and reports the finished ones through OnDone.
+            virtual void Poll() = 0;
+            virtual void Stop() = 0;
+
+            virtual size_t Count() const = 0;
+
+            void OnDone(COnDone &&Value) { m_OnDone = Value; }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CProcessExecutor ------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CProcessExecutor: public CJobExecutor {
+        private:
+
+            struct CChild {
+                CJobRef Job;
+                pid_t Pid = -1;
+                int Output = -1;
+                int Status = -1;
+            };
+
+            std::unordered_map<std::string, CString> m_Commands;
+            std::unordered_map<std::string, CChild> m_Children;
+
+            static int TempFile();
+            static void Close(int &Handle);
+
+            static int ExitCode(const CChild &Child, int Status, bool Reaped);
+            static CString Tail(int Handle);
+
+        public:
+
+            CProcessExecutor() = default;
+
+            ~CProcessExecutor() override {
+                Stop();
+            }
+
+            void Commands(const CStringList &List);
+
+            bool Handles(const CString &TypeCode) const override { return m_Commands.count(TypeCode.c_str()) != 0; }
+
+            void Start(const CJobRef &Job) override;
+            bool Cancel(const CString &Id) override;
+
+            void Poll() override;
+            void Stop() override;
+
+            size_t Count() const override { return m_Children.size(); }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CJournal --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CJournal {
+        public:
+
+            // How a job was started: the body and "execute" in one transaction, in two steps, or by an executor.
+            enum CMode { jmPipeline = 'P', jmTwoStep = 'T', jmExecutor = 'X' };
+
+            struct CEntry {
+                char Mode = jmTwoStep;
+                bool Executed = false;
+            };
+
+        private:
+
+            CString m_FileName;
+
+            int m_Handle;
+
+            std::string m_Buffer;
+            size_t m_Lines;
+
+            std::unordered_map<std::string, CEntry> m_Entries;
+
+            void Append(char Event, char Mode, const CString &Id);
+            void Compact();
+
+        public:
+
+            CJournal(): m_Handle(-1), m_Lines(0) {
+
+            }
+
+            ~CJournal() {
+                Close();
+            }
+
+            void Open(const CString &FileName);
+            void Close();
+
+            bool Active() const { return m_Handle != -1; }
+
+            void Start(const CString &Id, CMode Mode);
+            void Executed(const CString &Id);
+            void End(const CString &Id);
+
+            const CEntry *Find(const CString &Id) const;
+
+            void Flush();
+
+            size_t Count() const { return m_Entries.size(); }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CTaskScheduler --------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
@@ -44,6 +678,9 @@ namespace Apostol {
 
             CProcessStatus m_Status;
 
+            // Declared first and destroyed last: job contexts return to it.
+            CJobPool m_JobPool;
+
             CStringList m_Sessions;
 
             CString m_Agent;
@@ -51,10 +688,123 @@ namespace Apostol {
 
             CDateTime m_AuthDate;
             CDateTime m_CheckDate;
+            CDateTime m_ListenDate;
+
+            CTaskManager m_Jobs;
+
+            CPQPool m_Control;
+            CPQPool m_Execution;
+
+            bool m_Pipeline;
+            bool m_Batch;
+            bool m_FanIn;
+
+            bool m_Delta;
+            int m_DeltaErrors;
+            CString m_CursorColumn;
+            std::unordered_map<std::string, CSyncCursor> m_Cursors;
+
+            bool m_Notify;
+            CString m_Channel;
+            std::unordered_set<std::string> m_Notified;
+            bool m_NotifiedAll;
 
-            CStringList m_Jobs;
+            CReadyQueue m_Ready;
+
+            int m_MaxJobs;
+            int m_Active;
+
+            std::unordered_map<std::string, int> m_TypeLimits;
+            std::unordered_map<std::string, int> m_TypeActive;
+
+            std::unordered_map<std::string, CTokenBucket> m_TypeRates;
+            std::unordered_map<std::string, CTokenBucket> m_SessionRates;
+            std::unordered_map<std::string, CTokenBucket> m_SessionBuckets;
+
+            CDateTime m_RateDate;
+
+            typedef std::pair<CDateTime, std::string> CDeadline;
+
+            std::priority_queue<CDeadline, std::vector<CDeadline>, std::greater<CDeadline>> m_Deadlines;
+
+            int m_Timeout;
+            std::unordered_map<std::string, int> m_Timeouts;
+
+            int m_Misfire;
+            int m_CatchUp;
+            CMisfirePolicy m_MisfirePolicy;
+            std::unordered_map<std::string, CMisfirePolicy> m_MisfirePolicies;
+            std::unordered_map<std::string, CMisfireSeries> m_Misfired;
+
+            bool m_Prepare;
+            int m_AuthCache;
+            CString m_PreparedColumn;
+
+            bool m_Cluster;
+            CString m_Node;
+            CString m_ClusterChannel;
+
+            int m_Lease;
+
+            CDateTime m_AnnounceDate;
+            CDateTime m_JoinDate;
+
+            std::unordered_map<std::string, CDateTime> m_Nodes;
+
+            std::unordered_map<std::string, std::vector<std::string>> m_Depends;
+            std::unordered_set<std::string> m_Upstream;
+            std::unordered_set<std::string> m_Pending;
+            std::unordered_map<std::string, double> m_Finished;
+            std::unordered_map<std::string, double> m_LastRun;
+            CDateTime m_PendingDate;
+            bool m_PendingCheck;
+            bool m_PendingAgain;
+            std::unordered_map<std::string, CReadyJob> m_Blocked;
+
+            CJournal m_Journal;
+            CString m_JournalFile;
+
+            CTracer m_Tracer;
+
+            CProcessExecutor m_Processes;
+            std::vector<CJobExecutor *> m_Executors;
+
+            std::unordered_map<std::string, CBackoff> m_Retry;
+            CBackoff m_Reconnect;
+
+            int m_RetryMin;
+            int m_RetryMax;
+            int m_ReconnectMax;
+
+            CSchedulerMetrics m_Metrics;
+
+            CBenchmark m_Bench;
+            int m_BenchInterval;
+            CDateTime m_BenchDate;
+            int m_MetricsPort;
+
+            CTransitions m_Transitions;
+            std::unordered_map<CPQPollQuery *, CTransitions> m_Batches;
 
             int m_HeartbeatInterval;
+            int m_HeartbeatMax;
+            int m_Heartbeat;
+            bool m_Idle;
+
+            int m_PollInterval;
+
+            template<class TExecuted, class TException>
+            CPQPollQuery *ExecPool(CPQPool &Pool, const CStringList &SQL, TExecuted &&OnExecuted, TException &&OnException);
+
+            template<class TExecuted, class TException>
+            CPQPollQuery *ExecConnection(CPQConnection *AConnection, const CStringList &SQL, TExecuted &&OnExecuted, TException &&OnException);
+
+            void EnterPool(CPQPool &Pool);
+            void LeavePool(CPQPool &Pool);
+
+            void LoadConfig();
+            void LoadDepends();
+            void LoadRates();
 
             void BeforeRun() override;
             void AfterRun() override;
@@ -62,12 +812,82 @@ namespace Apostol {
             void Authentication();
             void SignOut(const CString &Session);
 
-            void EnumJob(const CString &Session, const CPQueryResult &List);
-            void CheckJob();
+            void InitListen();
+            bool CheckListen();
 
+            void EnumJob(const CString &Session, const CPQueryResult &List, const CStringList &Scope, bool Full);
+            void CheckJob(const CStringList &Ids = CStringList());
+            void CheckJob(const CStringList &Ids, const CStringList &Sessions);
+            void CheckNotified();
+
+            void Trace(const CString &Id, const CString &Action);
+            void Activity();
             void DeleteJob(const CString &Id);
 
+            void JobList(CStringList &SQL, const CString &Filter, const CSyncCursor *Cursor);
+
+            void Authorize(CStringList &SQL, const CString &Session) const;
+            void ExecuteAction(CStringList &SQL, const CString &Id, const CString &Action) const;
+            void SetLabel(CStringList &SQL, const CString &Id, const CString &Label) const;
+
+            void Prepare(CPQConnection *AConnection);
+            static void PrepareAuthCache(CStringList &SQL);
+
+            CJobRef NewJob(const CString &Session, const CString &Id);
+
+            void Enqueue(const CString &Session, const CString &Id, const CString &TypeCode, const CString &Body, const CString &DateRun,
+                         CDateTime Due, bool Missed = false, bool Skip = false);
+            CTokenBucket *SessionBucket(const CString &Session);
+            bool Admit(const CJobContext &Job, CDateTime Now);
+            void Charge(const CJobContext &Job, CDateTime Now);
+
+            bool Acquire(const CString &TypeCode);
+            void Release(const CString &TypeCode);
+            void Dispatch();
+
+            void JobStarted(const CString &Id, CPQQuery *AQuery);
+            int Timeout(const CString &Id, const CString &TypeCode) const;
+
+            static bool ParseMisfire(const CString &Value, CMisfirePolicy &Policy);
+            CMisfirePolicy MisfirePolicy(const CString &Id, const CString &TypeCode) const;
+            bool Misfired(const CString &Id, const CString &TypeCode, long long Delay, CDateTime &Due, bool &Skip);
+            bool Finishing(const CString &Id);
+            void CheckTimeout();
+
+            bool Satisfied(const CReadyJob &Job) const;
+            void CheckDepends();
+            void CheckDepends(const CStringList &Sessions);
+            void JobFinished(const CJobContext &Job, const CString &Action);
+            void Unblock();
+
+            void JobExecuted(const CJobRef &Job);
+            bool JobRecovered(const CString &Session, const CString &Id, const CString &TypeCode);
+
+            CJobExecutor *Executor(const CString &TypeCode) const;
+            void ExecutorDone(const CJobRef &Job, int Status, const CString &Output);
+            void CheckExecutors();
+
+            void Metrics(CString &Output) const;
+            void Benchmark(CDateTime Now);
+
+            void Announce(bool Join);
+            void NodeSeen(const CString &Payload);
+            void Membership(CDateTime Now);
+            void Rebalance();
+
+            static uint64_t Weight(const CString &Node, const CString &Id);
+
+            bool Owned(const CString &Id) const;
+            bool Orphaned(const CString &Owner) const;
+
             void Heartbeat(CDateTime Now);
+            void ScheduleTimer();
+
+            static CString TransitionMessage(const CString &Action);
+
+            void SendTransition(const CTransition &Transition);
+            void SendTransitions(const CTransitions &List);
+            void FlushTransitions();
 
         protected:
 
@@ -76,21 +896,34 @@ namespace Apostol {
             void DoFatal(const Delphi::Exception::Exception &E);
             void DoError(const Delphi::Exception::Exception &E);
 
-            void DoStart(const CString &Session, const CString &Id, const CString &TypeCode, const CString &Body);
-            void DoRun(const CString &Session, const CString &Id, const CString &TypeCode, const CString &Body);
+            int Backoff(CBackoff &Value, int Min, int Max);
+
+            void DoRetry(const CString &Id, const Delphi::Exception::Exception &E);
+            void LaunchFailed(const CJobRef &Job, const Delphi::Exception::Exception &E);
+            void DoConnectError(const Delphi::Exception::Exception &E);
+
+            void DoStart(const CJobRef &Job);
+            void DoRun(const CJobRef &Job);
 
-            void DoDone(const CString &Session, const CString &Id);
-            void DoComplete(const CString &Session, const CString &Id);
+            void DoLaunch(const CJobRef &Job);
 
-            void DoAbort(const CString &Session, const CString &Id);
-            void DoCancel(const CString &Session, const CString &Id);
-            void DoFail(const CString &Session, const CString &Id, const CString &Error);
+            void DoTransition(const CJobRef &Job, const CString &Action, const CString &Label = CString(), bool Execute = false);
+
+            void DoDone(const CJobRef &Job);
+            void DoComplete(const CJobRef &Job);
+
+            void DoAbort(const CJobRef &Job);
+            void DoCancel(const CJobRef &Job);
+            void DoFail(const CJobRef &Job, const CString &Error);
 
             bool DoExecute(CTCPConnection *AConnection) override;
 
+            void DoPostgresNotify(CPQConnection *AConnection, PGnotify *ANotify);
+
             void DoPostgresQueryExecuted(CPQPollQuery *APollQuery);
             void DoPostgresQueryException(CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E);
 
+            void DoPQConnect(CObject *Sender) override;
             void DoPQConnectException(CPQConnection *AConnection, const Delphi::Exception::Exception &E) override;
 
         public:
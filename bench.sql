@@ -0,0 +1,53 @@
+--------------------------------------------------------------------------------
+-- Task Scheduler benchmark seed
+--------------------------------------------------------------------------------
+-- Creates :jobs synthetic jobs, of which :periodic are periodic ("periodic.job")
+-- and the rest one-shot ("disposable.job"). Every job runs "SELECT pg_sleep(:sleep)"
+-- and is due within the first :spread seconds after the script ends.
+--
+-- psql -d <database> -U admin -v jobs=1000 -v periodic=100 -v sleep=0.05 -v spread=10 -f bench.sql
+--
+-- Objects are coded "bench-<run>-*", so the script can be run again on the same database.
+--------------------------------------------------------------------------------
+
+\set ON_ERROR_STOP on
+
+\if :{?jobs}
+\else
+  \set jobs 1000
+\endif
+\if :{?periodic}
+\else
+  \set periodic 100
+\endif
+\if :{?sleep}
+\else
+  \set sleep 0.05
+\endif
+\if :{?spread}
+\else
+  \set spread 10
+\endif
+
+SELECT 'bench-' || to_char(Now(), 'YYYYMMDDHH24MISS') AS prefix
+\gset
+
+BEGIN;
+
+SELECT api.add_scheduler(pType => GetType('job.scheduler'), pCode => :'prefix' || '-scheduler', pName => 'Benchmark',
+                         pPeriod => interval '1 minute', pDateStart => Now(), pDateStop => Now() + interval '1 day') AS scheduler
+\gset
+
+SELECT api.add_program(pType => GetType('plpgsql.program'), pCode => :'prefix' || '-program', pName => 'Benchmark',
+                       pBody => format('SELECT pg_sleep(%s);', :'sleep')) AS program
+\gset
+
+SELECT count(api.add_job(pType => GetType(CASE WHEN n <= :periodic THEN 'periodic.job' ELSE 'disposable.job' END),
+                         pScheduler => :'scheduler', pProgram => :'program',
+                         pDateRun => Now() + (n % greatest(:spread, 1)) * interval '1 second',
+                         pCode => :'prefix' || '-' || n))
+  FROM generate_series(1, :jobs) AS n;
+
+COMMIT;
+
+SELECT typecode, statecode, count(*) FROM api.job WHERE code LIKE :'prefix' || '-%' GROUP BY typecode, statecode ORDER BY 1, 2;